@@ -5,12 +5,17 @@ pub fn build(b: *std.Build) void {
     const target = b.standardTargetOptions(.{});
     const optimize = b.standardOptimizeOption(.{});
 
+    // Tracing is compiled out unless requested, so it costs nothing in regular builds
+    const options = b.addOptions();
+    options.addOption(bool, "trace", b.option(bool, "trace", "Record Chrome trace spans of commit and read phases") orelse false);
+
     const lib = b.addStaticLibrary(.{
         .name = "stitch",
         .root_source_file = .{ .path = "src/lib.zig" },
         .target = target,
         .optimize = optimize,
     });
+    lib.root_module.addOptions("build_options", options);
     b.installArtifact(lib);
 
     // Uncommenting this will use the C allocator instead of heap_allocator as the backing allocator
@@ -22,6 +27,7 @@ pub fn build(b: *std.Build) void {
         .target = target,
         .optimize = optimize,
     });
+    exe.root_module.addOptions("build_options", options);
     b.installArtifact(exe);
 
     const run_cmd = b.addRunArtifact(exe);
@@ -32,12 +38,28 @@ pub fn build(b: *std.Build) void {
     const run_step = b.step("run", "Run the app");
     run_step.dependOn(&run_cmd.step);
 
+    // Benchmarks are always built with optimizations enabled
+    const bench_exe = b.addExecutable(.{
+        .name = "stitch-bench",
+        .root_source_file = .{ .path = "src/bench.zig" },
+        .target = target,
+        .optimize = .ReleaseFast,
+    });
+    bench_exe.root_module.addOptions("build_options", options);
+    const bench_cmd = b.addRunArtifact(bench_exe);
+    if (b.args) |args| {
+        bench_cmd.addArgs(args);
+    }
+    const bench_step = b.step("bench", "Run benchmarks");
+    bench_step.dependOn(&bench_cmd.step);
+
     // Creates a step for unit testing.
     const main_tests = b.addTest(.{
         .root_source_file = .{ .path = "src/tests.zig" },
         .target = target,
         .optimize = optimize,
     });
+    main_tests.root_module.addOptions("build_options", options);
 
     const test_step = b.step("test", "Run library tests");
     test_step.dependOn(&main_tests.step);
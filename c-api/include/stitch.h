@@ -22,6 +22,7 @@ extern "C" {
 #define STITCH_ERROR_INVALID_EXECUTABLE_FORMAT 5
 #define STITCH_ERROR_RESOURCE_NOT_FOUND 6
 #define STITCH_ERROR_IO_ERROR 7
+#define STITCH_ERROR_INVALID_ARGUMENT 8
 
 // Start a new stitch session for appending resources to an executable. No file writes occur until stitch_writer_commit is called.
 // The returned writer session is passed to all other writer functions.
@@ -34,6 +35,8 @@ void* stitch_init_writer(const char* original_executable_path, const char* outpu
 // Start a new stitch session for reading resources. The returned session is passed to all other applicable functions.
 // You must call stitch_deinit to close the session, and free allocated memory.
 // If `executable_path` is NULL, the currently running executable is used. This enables executables to read resources from themselves.
+// All sessions opened this way share one loaded index and file handle, which are freed when the last of them is closed,
+// so opening the running executable from several components costs a single index parse. Each session has its own diagnostics.
 // On error, `error_code` is set to the error code and NULL is returned.
 void* stitch_init_reader(const char* executable_path, uint64_t* error_code);
 
@@ -60,10 +63,64 @@ uint64_t stitch_reader_get_resource_byte_len(void* reader, uint64_t index, uint6
 
 // Returns the data of the resource at the given index
 // Use `stitch_reader_get_resource_byte_len` to get the size of the returned resource
+// Where supported, the executable is memory-mapped and the returned pointer points directly into the mapping.
+// Either way, the memory is owned by the session and is valid until `stitch_deinit` is called.
 // On error, `error_code` is set to the error code and NULL is returned.
 // Error code is STITCH_ERROR_RESOURCE_NOT_FOUND if the resource index is invalid.
 const char* stitch_reader_get_resource_bytes(void* reader, uint64_t index, uint64_t* error_code);
 
+// Reads up to `len` bytes of the resource, starting at `offset` within the resource, into `buffer`, and returns the number of bytes read.
+// This is less than `len` only when the range reaches the end of the resource, and 0 if `offset` is at or past the end.
+// Nothing is allocated by the session, so the same buffer can be reused to read resources any number of times.
+// Uncompressed resources are read with a single positional read. Compressed resources are decompressed.
+// On error, `error_code` is set to the error code and UINT64_MAX is returned.
+// Error code is STITCH_ERROR_RESOURCE_NOT_FOUND if the resource index is invalid.
+uint64_t stitch_reader_read(void* reader, uint64_t index, uint64_t offset, char* buffer, uint64_t len, uint64_t* error_code);
+
+// Opens a stream for reading the resource incrementally, in constant memory regardless of the resource size.
+// Each stream has its own read-ahead buffer, and compressed resources are decompressed while reading.
+// Streams on the same session can be used from different threads, but each stream must only be used by one thread at a time.
+// You must call stitch_stream_close to close the stream, before the session is closed.
+// On error, `error_code` is set to the error code and NULL is returned.
+// Error code is STITCH_ERROR_RESOURCE_NOT_FOUND if the resource index is invalid.
+void* stitch_reader_open_stream(void* reader, uint64_t index, uint64_t* error_code);
+
+// Reads up to `len` bytes from the stream into `buffer`, and returns the number of bytes read.
+// This is less than `len` only at the end of the resource, and 0 once the end is reached.
+// On error, `error_code` is set to the error code and UINT64_MAX is returned. Diagnostics are set on the stream's session.
+uint64_t stitch_stream_read(void* stream, char* buffer, uint64_t len, uint64_t* error_code);
+
+// Moves the stream to the given position within the (uncompressed) resource. Positions past the end are clamped to the end.
+// Seeking in uncompressed and chunked resources is cheap. Other compressed resources are decompressed up to the new position,
+// from the start of the resource when seeking backwards.
+// On error, `error_code` is set to the error code.
+void stitch_stream_seek(void* stream, uint64_t position, uint64_t* error_code);
+
+// Returns the current position of the stream within the resource
+uint64_t stitch_stream_tell(void* stream);
+
+// Closes a stream returned by `stitch_reader_open_stream`. Calling this function with a NULL pointer is a safe no-op.
+void stitch_stream_close(void* stream);
+
+// Returns a sealed memory file descriptor (memfd) holding the resource, which can be passed to
+// dlopen("/proc/self/fd/N") or fexecve without writing the resource to disk. Compressed resources are decompressed.
+// The caller owns the file descriptor and must close it. This is only supported on Linux.
+// On error, `error_code` is set to the error code and -1 is returned.
+// Error code is STITCH_ERROR_RESOURCE_NOT_FOUND if the resource index is invalid.
+int stitch_reader_get_resource_memfd(void* reader, uint64_t index, uint64_t* error_code);
+
+// Extracts the resource to an executable file in `cache_dir_path` and returns the path of the file.
+// A resource is extracted once and then reused by later runs and other processes sharing the cache directory,
+// which only costs a stat. With content digests, files are named by the digest of their content and shared across executables.
+// The memory for the returned path is owned by the session and is freed when `stitch_deinit` is called.
+// On error, `error_code` is set to the error code and NULL is returned.
+const char* stitch_reader_extract_resource(void* reader, uint64_t index, const char* cache_dir_path, uint64_t* error_code);
+
+// Verify every resource against the checksums recorded by the writer, stopping at the first corrupt resource.
+// Resources written without checksums always pass.
+// On error, `error_code` is set to the error code. Error code is STITCH_ERROR_INVALID_EXECUTABLE_FORMAT if a resource is corrupt.
+void stitch_reader_verify_all(void* reader, uint64_t* error_code);
+
 // Returns the scratch bytes for the resource, which is all-zeros if not set specifically.
 // On error, `error_code` is set to the error code and NULL is returned.
 // Error code is STITCH_ERROR_RESOURCE_NOT_FOUND if the resource index is invalid.
@@ -92,8 +149,61 @@ uint64_t stitch_writer_add_resource_from_bytes(void* writer, const char* name, c
 // Returns true if the scratch bytes were set successfully, or false if an error occurs.
 void stitch_writer_set_scratch_bytes(void* writer, uint64_t resource_index, const char* bytes, uint64_t* error_code);
 
+// Record a checksum of every resource in the index, so readers can detect corrupt resources.
+void stitch_writer_set_checksums(void* writer, bool enabled);
+
+// Record a digest of every resource's content in the index, so resources extracted with `stitch_reader_extract_resource`
+// are shared by executables with the same content.
+void stitch_writer_set_content_digests(void* writer, bool enabled);
+
+// Pad the output so the data of every resource starts at a multiple of `alignment`, such as 64, 4096 or 2 MiB.
+// The alignment must be a power of two. The default of 1 adds no padding.
+// On error, `error_code` is set to STITCH_ERROR_INVALID_ARGUMENT.
+void stitch_writer_set_alignment(void* writer, uint64_t alignment, uint64_t* error_code);
+
+// Start writing trace spans of commit and read phases to a Chrome trace JSON file, which can be opened in Perfetto.
+// Without this call, spans are written to the file named by the STITCH_TRACE environment variable, if it's set.
+// Spans are only recorded if the library is built with `-Dtrace`; otherwise this does nothing.
+// On error, `error_code` is set to STITCH_ERROR_OUTPUT_FILE_COULD_NOT_OPEN.
+void stitch_start_trace(const char* path, uint64_t* error_code);
+
+// Stop writing trace spans and close the trace file
+void stitch_stop_trace();
+
+// Counters kept by every session, filled in by `stitch_get_stats`. Durations are in nanoseconds.
+typedef struct stitch_stats {
+    // Number of I/O operations issued: reads, writes, copies and maps of the executable, resource files, the output,
+    // extracted files, and the temporary files of commit. This is approximate, since an operation can take several
+    // system calls; a kernel copy is one operation however many calls it loops over.
+    uint64_t syscalls;
+    // Bytes read from the executable, resource files and temporary files. For memory-mapped executables, this includes
+    // bytes read from the mapping. Bytes that pass through a temporary file during commit are counted again when read back.
+    uint64_t bytes_read;
+    // Bytes written to the output, memory files, extracted files and temporary files
+    uint64_t bytes_written;
+    // Time spent loading and parsing the index
+    uint64_t index_load_ns;
+    // Resource lookups by name, and how many of them found no resource
+    uint64_t lookups;
+    uint64_t lookup_misses;
+    // Memory reserved by the session
+    uint64_t arena_bytes;
+    // Commit time spent copying the original executable, compressing, hashing, writing the index, and writing resource data
+    uint64_t commit_copy_ns;
+    uint64_t commit_compress_ns;
+    uint64_t commit_hash_ns;
+    uint64_t commit_index_ns;
+    uint64_t commit_fill_ns;
+    // Total time spent in stitch_writer_commit
+    uint64_t commit_ns;
+} stitch_stats;
+
+// Fills in `stats` with a snapshot of the session's counters. This is safe to call from multiple threads.
+void stitch_get_stats(void* session, stitch_stats* stats);
+
 // If an error is produced by an API function, the returned string is a human-readable diagnostic message,
-// otherwise NULL is returned. Every API function resets the diagnostic.
+// otherwise NULL is returned. Every API function resets the diagnostic. Diagnostics are kept per thread, so this
+// describes the last call on the calling thread.
 // The memory for the returned string is owned by the session and is freed when `stitch_deinit` is called.
 char* stitch_get_last_error_diagnostic(void* session);
 
@@ -9,6 +9,9 @@
 #include <stitch.h>
 #include <stdio.h>
 #include <inttypes.h>
+#ifdef __linux__
+#include <unistd.h>
+#endif
 
 void stitch_test_setup();
 void stitch_test_teardown();
@@ -90,6 +93,55 @@ int main() {
     }
     printf("Scratch bytes for resource 0 are: %.*s\n", 8, scratch_bytes);
 
+    // Read part of resource 1 into a caller-provided buffer
+    char range[8];
+    uint64_t range_len = stitch_reader_read(reader, 1, 1, range, sizeof(range), &error_code);
+    if (error_code || range_len != 3) {
+        printf("Failed to read range of resource 1: %" PRIu64 " (%s)\n", error_code, stitch_get_last_error_diagnostic(reader));
+        return 1;
+    }
+    printf("Bytes 1-3 of resource 1: %.*s\n", (int)range_len, range);
+
+    // Stream resource 1 in small pieces
+    void* stream = stitch_reader_open_stream(reader, 1, &error_code);
+    if (error_code) {
+        printf("Failed to open stream for resource 1: %" PRIu64 " (%s)\n", error_code, stitch_get_last_error_diagnostic(reader));
+        return 1;
+    }
+    stitch_stream_seek(stream, 2, &error_code);
+    char piece[2];
+    uint64_t piece_len = stitch_stream_read(stream, piece, sizeof(piece), &error_code);
+    if (error_code || piece_len != 2 || stitch_stream_tell(stream) != 4 || stitch_stream_read(stream, piece, sizeof(piece), &error_code) != 0) {
+        printf("Failed to stream resource 1: %" PRIu64 " (%s)\n", error_code, stitch_get_last_error_diagnostic(reader));
+        return 1;
+    }
+    printf("Streamed bytes 2-3 of resource 1: %.*s\n", (int)piece_len, piece);
+    stitch_stream_close(stream);
+
+#ifdef __linux__
+    // Extract resource 1 into a memory file
+    int fd = stitch_reader_get_resource_memfd(reader, 1, &error_code);
+    if (error_code) {
+        printf("Failed to get memfd for resource 1: %" PRIu64 " (%s)\n", error_code, stitch_get_last_error_diagnostic(reader));
+        return 1;
+    }
+    char memfd_bytes[4];
+    if (pread(fd, memfd_bytes, 4, 0) != 4) {
+        printf("Failed to read memfd for resource 1\n");
+        return 1;
+    }
+    printf("Memfd bytes for resource 1: %.*s\n", 4, memfd_bytes);
+    close(fd);
+#endif
+
+    stitch_stats stats;
+    stitch_get_stats(reader, &stats);
+    printf("Lookups: %" PRIu64 ", bytes read: %" PRIu64 "\n", stats.lookups, stats.bytes_read);
+    if (stats.lookups != 1) {
+        printf("Unexpected lookup count\n");
+        return 1;
+    }
+
     // Clear memory allocated by stitch, including all resource data
     // If you need to keep the resources around after deinitializing stitch, you need to copy them first
     stitch_deinit(reader);
@@ -0,0 +1,364 @@
+//! Stitch benchmarks. Run with `zig build bench`, optionally followed by `-- [options]`:
+//!
+//!   --json <path>            Also write the results as JSON, for comparing runs. Use `-` for stdout, which moves
+//!                            the table to stderr.
+//!   --max-resources <count>  Skip cases with more resources than this (default 1000000)
+//!   --max-size <bytes>       Skip cases with resources larger than this (default 1 GiB)
+//!
+//! Synthetic executables are generated in `.stitch`, with 1 to 1M resources of 16 bytes, and single resources of
+//! 16 bytes to 1 GiB. Reads are measured with a warm page cache, and on Linux also with a cold one, by dropping
+//! the executable's pages before every iteration.
+const std = @import("std");
+const builtin = @import("builtin");
+const Stitch = @import("lib.zig");
+
+const resource_counts = [_]u64{ 1, 100, 10_000, 1_000_000 };
+const resource_sizes = [_]u64{ 16, 4 * 1024, 1024 * 1024, 64 * 1024 * 1024, 1024 * 1024 * 1024 };
+
+/// Size of each resource when benchmarking resource counts
+const small_resource_size = 16;
+
+/// Warm benchmarks repeat until they've run for this long, to even out noise
+const min_time_ns = 200 * std.time.ns_per_ms;
+
+/// One measurement. Fields that don't apply to a benchmark are left out of the JSON output.
+const Result = struct {
+    benchmark: []const u8,
+    resources: u64,
+    resource_size: u64,
+    mode: ?[]const u8 = null,
+    cache: ?[]const u8 = null,
+    iterations: u64,
+    ns_per_op: f64,
+    bytes_per_second: ?f64 = null,
+};
+
+const Cache = enum { warm, cold };
+
+/// Cold page cache cases need a way to evict a file's pages, which is only implemented on Linux
+const caches: []const Cache = if (builtin.os.tag == .linux) &.{ .warm, .cold } else &.{.warm};
+
+const Options = struct {
+    json_path: ?[]const u8 = null,
+    max_resources: u64 = resource_counts[resource_counts.len - 1],
+    max_size: u64 = resource_sizes[resource_sizes.len - 1],
+};
+
+const Suite = struct {
+    allocator: std.mem.Allocator,
+    results: std.ArrayList(Result),
+    /// Where the table is printed: stdout, unless the JSON output goes there
+    table: std.fs.File,
+
+    // Record a result and print it as a table row
+    fn record(suite: *Suite, result: Result) !void {
+        try suite.results.append(result);
+        const mb_per_second = if (result.bytes_per_second) |bps| bps / (1024 * 1024) else 0;
+        try suite.table.writer().print("{s:<8} {d:>10} {d:>12} {s:>7} {s:>5} {d:>8} {d:>16.1} {d:>10.1}\n", .{
+            result.benchmark,
+            result.resources,
+            result.resource_size,
+            result.mode orelse "-",
+            result.cache orelse "-",
+            result.iterations,
+            result.ns_per_op,
+            mb_per_second,
+        });
+    }
+};
+
+pub fn main() !void {
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const options = try parseOptions(allocator);
+    const json_to_stdout = options.json_path != null and std.mem.eql(u8, options.json_path.?, "-");
+    var suite = Suite{
+        .allocator = allocator,
+        .results = std.ArrayList(Result).init(allocator),
+        .table = if (json_to_stdout) std.io.getStdErr() else std.io.getStdOut(),
+    };
+
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    try suite.table.writer().print("{s:<8} {s:>10} {s:>12} {s:>7} {s:>5} {s:>8} {s:>16} {s:>10}\n", .{
+        "bench", "resources", "size", "mode", "cache", "iters", "ns/op", "MB/s",
+    });
+
+    // Many small resources: index size dominates
+    for (resource_counts) |count| {
+        if (count > options.max_resources) continue;
+        const path = try benchCommit(&suite, count, small_resource_size);
+        defer std.fs.cwd().deleteFile(path) catch {};
+        for (caches) |cache| {
+            try benchOpen(&suite, path, count, cache, false);
+            try benchOpen(&suite, path, count, cache, true);
+        }
+        try benchLookup(&suite, path, count);
+        for ([_]Stitch.ReadMode{ .mapped, .file }) |mode| {
+            try benchSmallSlices(&suite, path, count, mode);
+        }
+    }
+
+    // Single resources: data size dominates
+    for (resource_sizes) |size| {
+        if (size > options.max_size) continue;
+        const path = try benchCommit(&suite, 1, size);
+        defer std.fs.cwd().deleteFile(path) catch {};
+        for (caches) |cache| {
+            for ([_]Stitch.ReadMode{ .mapped, .file }) |mode| {
+                try benchRead(&suite, path, size, mode, cache, .slice);
+                try benchRead(&suite, path, size, mode, cache, .stream);
+            }
+        }
+    }
+
+    if (options.json_path) |json_path| {
+        const json_options = std.json.StringifyOptions{ .whitespace = .indent_2, .emit_null_optional_fields = false };
+        const report = .{ .os = @tagName(builtin.os.tag), .arch = @tagName(builtin.cpu.arch), .results = suite.results.items };
+        if (json_to_stdout) {
+            try std.json.stringify(report, json_options, std.io.getStdOut().writer());
+        } else {
+            const file = try std.fs.cwd().createFile(json_path, .{});
+            defer file.close();
+            var buffered = std.io.bufferedWriter(file.writer());
+            try std.json.stringify(report, json_options, buffered.writer());
+            try buffered.flush();
+        }
+    }
+}
+
+fn parseOptions(allocator: std.mem.Allocator) !Options {
+    var options = Options{};
+    const args = try std.process.argsAlloc(allocator);
+    var i: usize = 1;
+    while (i < args.len) : (i += 1) {
+        const arg = args[i];
+        if (i + 1 >= args.len) return usage(arg);
+        i += 1;
+        if (std.mem.eql(u8, arg, "--json")) {
+            options.json_path = args[i];
+        } else if (std.mem.eql(u8, arg, "--max-resources")) {
+            options.max_resources = std.fmt.parseInt(u64, args[i], 10) catch return usage(arg);
+        } else if (std.mem.eql(u8, arg, "--max-size")) {
+            options.max_size = std.fmt.parseInt(u64, args[i], 10) catch return usage(arg);
+        } else {
+            return usage(arg);
+        }
+    }
+    return options;
+}
+
+fn usage(arg: []const u8) error{InvalidArgument} {
+    std.debug.print("Invalid argument: {s}\nUsage: stitch-bench [--json <path>] [--max-resources <count>] [--max-size <bytes>]\n", .{arg});
+    return error.InvalidArgument;
+}
+
+/// Stitch `count` resources of `size` bytes with distinct content, measure the time from `initWriter` through `commit`,
+/// and return the path of the stitched executable. Resources larger than 1 MiB are added from a file, like large assets.
+fn benchCommit(suite: *Suite, count: u64, size: u64) ![]const u8 {
+    const allocator = suite.allocator;
+    const large = size > 1024 * 1024;
+
+    const names = try allocator.alloc([]const u8, count);
+    for (names, 0..) |*name, i| name.* = try std.fmt.allocPrint(allocator, "scripts/module-{d}.lisp", .{i});
+    var prng = std.rand.DefaultPrng.init(count ^ size);
+    const data = try allocator.alloc(u8, if (large) 0 else count * size);
+    prng.random().bytes(data);
+    const source_path = if (large) try writeRandomFile(allocator, size, prng.random()) else "";
+    defer if (large) std.fs.cwd().deleteFile(source_path) catch {};
+
+    const path = try Stitch.generateUniqueFileName(allocator);
+    const iterations: u64 = if (count * size >= 64 * 1024 * 1024 or count >= 10_000) 1 else 5;
+    var total: u64 = 0;
+    for (0..iterations) |_| {
+        std.fs.cwd().deleteFile(path) catch {};
+        var timer = try std.time.Timer.start();
+        var writer = try Stitch.initWriter(std.heap.page_allocator, ".stitch/executable", path);
+        defer writer.deinit();
+        if (large) {
+            _ = try writer.addResourceFromPath(names[0], source_path);
+        } else {
+            for (names, 0..) |name, i| _ = try writer.addResourceFromSlice(name, data[i * size ..][0..size]);
+        }
+        try writer.commit();
+        total += timer.read();
+    }
+
+    const ns_per_op = @as(f64, @floatFromInt(total)) / @as(f64, @floatFromInt(iterations));
+    try suite.record(.{
+        .benchmark = "commit",
+        .resources = count,
+        .resource_size = size,
+        .iterations = iterations,
+        .ns_per_op = ns_per_op,
+        .bytes_per_second = bytesPerSecond(count * size, ns_per_op),
+    });
+    return path;
+}
+
+/// Measure `initReader`, which reads the tail and index, or only the tail with a lazy index
+fn benchOpen(suite: *Suite, path: []const u8, count: u64, cache: Cache, lazy: bool) !void {
+    const Open = struct {
+        path: []const u8,
+        lazy: bool,
+
+        fn run(ctx: @This()) !void {
+            var reader = try Stitch.initReaderWithOptions(std.heap.page_allocator, ctx.path, .{ .lazy_index = ctx.lazy });
+            reader.deinit();
+        }
+    };
+    const timing = try measure(path, cache, Open{ .path = path, .lazy = lazy });
+    try suite.record(.{
+        .benchmark = if (lazy) "open-lazy" else "open",
+        .resources = count,
+        .resource_size = small_resource_size,
+        .cache = @tagName(cache),
+        .iterations = timing.iterations,
+        .ns_per_op = timing.ns_per_op,
+    });
+}
+
+/// Measure the average time it takes to look up a random resource by name. This should stay flat as the number of resources grows.
+fn benchLookup(suite: *Suite, path: []const u8, count: u64) !void {
+    var reader = try Stitch.initReader(std.heap.page_allocator, path);
+    defer reader.deinit();
+
+    // Pick the names up front, so only the lookups are measured
+    const lookup_count = 1_000_000;
+    const queries = try suite.allocator.alloc([]const u8, lookup_count);
+    var prng = std.rand.DefaultPrng.init(count);
+    for (queries) |*query| {
+        query.* = try std.fmt.allocPrint(suite.allocator, "scripts/module-{d}.lisp", .{prng.random().uintLessThan(u64, count)});
+    }
+
+    var timer = try std.time.Timer.start();
+    for (queries) |query| {
+        std.mem.doNotOptimizeAway(try reader.getResourceIndex(query));
+    }
+    try suite.record(.{
+        .benchmark = "lookup",
+        .resources = count,
+        .resource_size = small_resource_size,
+        .iterations = lookup_count,
+        .ns_per_op = @as(f64, @floatFromInt(timer.read())) / lookup_count,
+    });
+}
+
+/// Measure `getResourceAsSlice` of random small resources in an open session, with a warm page cache
+fn benchSmallSlices(suite: *Suite, path: []const u8, count: u64, mode: Stitch.ReadMode) !void {
+    var reader = try Stitch.initReaderWithOptions(std.heap.page_allocator, path, .{ .mode = mode });
+    defer reader.deinit();
+
+    const slice_count = 100_000;
+    const indices = try suite.allocator.alloc(u64, slice_count);
+    var prng = std.rand.DefaultPrng.init(count);
+    for (indices) |*index| index.* = prng.random().uintLessThan(u64, count);
+
+    var timer = try std.time.Timer.start();
+    for (indices) |index| {
+        const slice = try reader.getResourceAsSlice(index);
+        std.mem.doNotOptimizeAway(slice[0]);
+    }
+    try suite.record(.{
+        .benchmark = "slice",
+        .resources = count,
+        .resource_size = small_resource_size,
+        .mode = @tagName(mode),
+        .cache = "warm",
+        .iterations = slice_count,
+        .ns_per_op = @as(f64, @floatFromInt(timer.read())) / slice_count,
+    });
+}
+
+const ReadMethod = enum { slice, stream };
+
+/// Measure opening a session and reading its single resource, either with `getResourceAsSlice` or streamed through a
+/// resource reader. Every byte is hashed, so mapped slices are measured by the cost of faulting their pages in.
+fn benchRead(suite: *Suite, path: []const u8, size: u64, mode: Stitch.ReadMode, cache: Cache, method: ReadMethod) !void {
+    const Read = struct {
+        path: []const u8,
+        mode: Stitch.ReadMode,
+        method: ReadMethod,
+
+        fn run(ctx: @This()) !void {
+            var reader = try Stitch.initReaderWithOptions(std.heap.page_allocator, ctx.path, .{ .mode = ctx.mode });
+            defer reader.deinit();
+            var hasher = std.hash.Wyhash.init(0);
+            switch (ctx.method) {
+                .slice => hasher.update(try reader.getResourceAsSlice(0)),
+                .stream => {
+                    var resource_reader = try reader.getResourceReader(0);
+                    defer resource_reader.deinit();
+                    var buffer: [64 * 1024]u8 = undefined;
+                    while (true) {
+                        const bytes_read = try resource_reader.read(&buffer);
+                        if (bytes_read == 0) break;
+                        hasher.update(buffer[0..bytes_read]);
+                    }
+                },
+            }
+            std.mem.doNotOptimizeAway(hasher.final());
+        }
+    };
+    const timing = try measure(path, cache, Read{ .path = path, .mode = mode, .method = method });
+    try suite.record(.{
+        .benchmark = @tagName(method),
+        .resources = 1,
+        .resource_size = size,
+        .mode = @tagName(mode),
+        .cache = @tagName(cache),
+        .iterations = timing.iterations,
+        .ns_per_op = timing.ns_per_op,
+        .bytes_per_second = bytesPerSecond(size, timing.ns_per_op),
+    });
+}
+
+const Timing = struct { iterations: u64, ns_per_op: f64 };
+
+/// Run `ctx.run()` repeatedly and return the average time per run. Cold runs evict the file at `path` from the page
+/// cache before each run, outside the measured time.
+fn measure(path: []const u8, cache: Cache, ctx: anytype) !Timing {
+    const max_iterations: u64 = if (cache == .cold) 5 else 1000;
+    var total: u64 = 0;
+    var iterations: u64 = 0;
+    while (iterations < max_iterations and (iterations < 3 or total < min_time_ns)) : (iterations += 1) {
+        if (cache == .cold) try dropPageCache(path);
+        var timer = try std.time.Timer.start();
+        try ctx.run();
+        total += timer.read();
+    }
+    return .{ .iterations = iterations, .ns_per_op = @as(f64, @floatFromInt(total)) / @as(f64, @floatFromInt(iterations)) };
+}
+
+// Evict the file's pages from the page cache, so the next read goes to the disk
+fn dropPageCache(path: []const u8) !void {
+    if (builtin.os.tag != .linux) return error.Unsupported;
+    const file = try std.fs.cwd().openFile(path, .{});
+    defer file.close();
+    try file.sync();
+    const rc = std.os.linux.fadvise(file.handle, 0, 0, std.os.linux.POSIX_FADV.DONTNEED);
+    if (std.os.linux.getErrno(rc) != .SUCCESS) return error.Unexpected;
+}
+
+// Write `size` random bytes to a new file in `.stitch` and return its path
+fn writeRandomFile(allocator: std.mem.Allocator, size: u64, random: std.rand.Random) ![]const u8 {
+    const path = try std.fmt.allocPrint(allocator, ".stitch/bench-{d}.bin", .{size});
+    const file = try std.fs.cwd().createFile(path, .{});
+    defer file.close();
+    var block: [1024 * 1024]u8 = undefined;
+    var remaining = size;
+    while (remaining > 0) {
+        const len: usize = @intCast(@min(remaining, block.len));
+        random.bytes(block[0..len]);
+        try file.writeAll(block[0..len]);
+        remaining -= len;
+    }
+    return path;
+}
+
+fn bytesPerSecond(bytes: u64, ns_per_op: f64) f64 {
+    return @as(f64, @floatFromInt(bytes)) * std.time.ns_per_s / ns_per_op;
+}
@@ -1,17 +1,20 @@
 //! The Stitch library and C wrapper
 const std = @import("std");
 const builtin = @import("builtin");
+const build_options = @import("build_options");
 const testing = std.testing;
+const Blake3 = std.crypto.hash.Blake3;
 const Self = @This();
 
 arena: std.heap.ArenaAllocator,
 rw: union(enum) {
     writer: StitchWriter,
+    streaming_writer: StitchStreamingWriter,
     reader: StitchReader,
 } = undefined,
 
-/// This is set whenever a StitchError is returned
-diagnostics: ?Diagnostic = null,
+/// Identifies the session in each thread's diagnostic slots. Unlike the session's address, it's never reused.
+id: u64,
 
 /// The executable to read from, or write to if stitching to the original
 org_exe_file: std.fs.File = undefined,
@@ -19,10 +22,49 @@ org_exe_file: std.fs.File = undefined,
 /// The output executable. If this is null, the resources will be stitched to the original
 output_exe_file: ?std.fs.File = null,
 
+/// Read-only mapping of the executable, if the reader session is in `mapped` mode
+mapped_exe: ?[]align(std.mem.page_size) const u8 = null,
+
+/// Guards the arena, so a reader session can be used from multiple threads
+mutex: std.Thread.Mutex = .{},
+
+/// Serializes loading the index of a reader opened with `lazy_index`
+index_mutex: std.Thread.Mutex = .{},
+
+/// The process-wide self reader whose index, file and mapping this session uses, if opened with `initSharedSelfReader`
+shared: ?*Self = null,
+
+/// Memory of the resource readers created by this session that haven't been closed with `deinit`, freed with the session
+reader_memory: ?*ReaderMemory = null,
+
+/// Session counters, in the order of the `Stats` fields. These are updated atomically, so reader threads don't contend.
+counters: [std.meta.fields(Stats).len]std.atomic.Value(u64) = [_]std.atomic.Value(u64){std.atomic.Value(u64).init(0)} ** std.meta.fields(Stats).len,
+
 pub const ResourceMagic: u64 = 0x18c767a11ea80843;
 pub const EofMagic: u64 = 0xa2a7fdfa0533438f;
+
+/// End-of-file magic of format version 2. Version 2 changes the index layout, so it has its own magic,
+/// which readers that only understand version 1 reject instead of misparsing the index.
+pub const EofMagicV2: u64 = 0x3c9e58b1d4f7206a;
+
+// The end-of-file magic written for a format version
+fn eofMagic(version: u8) u64 {
+    return if (version >= 2) EofMagicV2 else EofMagic;
+}
 pub const StitchVersion: u8 = 0x1;
 
+/// The most recent format version understood by this library. Use `StitchWriter.setFormatVersion` to write it.
+pub const LatestStitchVersion: u8 = 0x3;
+
+/// Format version written whenever a resource is compressed. Version 3 has the layout of version 2, but readers that
+/// predate compressed resource types reject it, rather than return the compressed bytes as resource contents.
+pub const CompressedStitchVersion: u8 = 0x3;
+
+// The format version written for a payload requested as `version`, which is raised if any resource is compressed
+fn payloadVersion(version: u8, any_compressed: bool) u8 {
+    return if (any_compressed) @max(version, CompressedStitchVersion) else version;
+}
+
 const StitchExecutable = struct {
     resources: std.ArrayList(Resource),
     index: Index,
@@ -30,7 +72,33 @@ const StitchExecutable = struct {
 };
 
 const Index = struct {
+    /// Parsed entries. This is used by the writer, and by the reader for version 1 indices.
     entries: std.ArrayList(IndexEntry),
+
+    /// Version 2 records, used in place from the loaded or mapped index bytes
+    records: []const IndexRecord = &.{},
+
+    /// Version 2 string table, which record names refer into
+    strings: []const u8 = "",
+
+    /// Raw uncompressed lengths extension, with one integer per resource in the byte order of the index
+    uncompressed_lengths: []const u8 = "",
+
+    /// Alignment of the resource data offsets, from the resource alignment extension
+    resource_alignment: u64 = 1,
+
+    /// Length of the original executable, from the executable length extension
+    executable_length: ?u64 = null,
+
+    /// Raw content digests extension, with one BLAKE3 digest per resource
+    content_digests: []const u8 = "",
+
+    /// Raw checksums extension, with one CRC-32C per resource in the byte order of the index
+    checksums: []const u8 = "",
+
+    /// Maps resource names to entry indices. This is built by the reader when the index is loaded.
+    /// If several resources have the same name, the first one is found, as with a linear search.
+    lookup: std.StringHashMapUnmanaged(u64) = .{},
 };
 
 const IndexEntry = struct {
@@ -39,6 +107,64 @@ const IndexEntry = struct {
     resource_offset: u64,
     byte_length: u64,
     scratch_bytes: [8]u8,
+    /// Same as `byte_length` unless the resource is compressed. Readers get this from the index extension.
+    uncompressed_length: u64 = 0,
+};
+
+/// Values of the index entry `resource_type` field
+const EntryType = struct {
+    /// Uncompressed bytes. Any type not listed here is also read as uncompressed bytes.
+    const blob: u8 = 0;
+    /// Raw DEFLATE stream (RFC 1951)
+    const deflate: u8 = 2;
+    /// Chunk table followed by independently compressed raw DEFLATE chunks, for random access
+    const deflate_chunked: u8 = 3;
+};
+
+// Returns the codec a resource was stored with, given its index entry type
+fn entryCodec(resource_type: u8) Codec {
+    return switch (resource_type) {
+        EntryType.deflate => .deflate,
+        EntryType.deflate_chunked => .deflate_chunked,
+        else => .none,
+    };
+}
+
+/// Tags of the optional extensions following the index entries. Readers skip tags they don't know.
+const IndexExtension = struct {
+    /// One u64 per resource with its uncompressed length
+    const uncompressed_lengths: u64 = 1;
+    /// A single u64 with the alignment of every resource's data offset
+    const resource_alignment: u64 = 2;
+    /// One 32-byte BLAKE3 digest per resource, of its uncompressed content
+    const content_digests: u64 = 3;
+    /// One u32 CRC-32C per resource, of its stored bytes
+    const checksums: u64 = 4;
+    /// A single u64 with the length of the original executable, which is where the payload starts. Alignment
+    /// padding can separate the executable from the first resource, so this is written when resources are aligned.
+    const executable_length: u64 = 5;
+};
+
+// Byte order of the index fields, and of index extensions, for the given format version
+fn indexEndian(version: u8) std.builtin.Endian {
+    return if (version >= 2) .little else .big;
+}
+
+/// Fixed-size version 2 index record. Fields are little-endian and records are naturally aligned in the file,
+/// so a loaded or mapped index is used in place without parsing.
+const IndexRecord = extern struct {
+    resource_offset: u64,
+    byte_length: u64,
+    /// Offset of the name in the string table
+    name_offset: u64,
+    name_length: u32,
+    resource_type: u8,
+    reserved: [3]u8,
+    scratch_bytes: [8]u8,
+
+    comptime {
+        std.debug.assert(@sizeOf(IndexRecord) == 40);
+    }
 };
 
 const Tail = struct {
@@ -60,10 +186,29 @@ const Resource = struct {
         path: []const u8,
         reader: std.fs.File.Reader,
     },
+    codec: Codec = .none,
+};
+
+/// Compression applied to a resource when it's written. See `StitchWriter.setCompression`
+/// DEFLATE is the only codec, since the standard library implements it without adding a dependency,
+/// and every resource type added to the format must be decoded by every reader.
+pub const Codec = enum {
+    none,
+    /// DEFLATE, which typically shrinks text, scripts and JSON 4-8x
+    deflate,
+    /// DEFLATE in independently compressed chunks of `ChunkSize` bytes. This compresses slightly worse than
+    /// `deflate`, but a resource reader seeking anywhere in the resource only decompresses the chunk it lands in.
+    deflate_chunked,
 };
 
+/// Uncompressed size of the chunks of `deflate_chunked` resources
+pub const ChunkSize: u64 = 64 * 1024;
+
+/// Largest chunk size accepted by readers, which bounds the memory used by a chunk cache
+const MaxChunkSize: u64 = 16 * 1024 * 1024;
+
 /// This is the type of error returned by all API functions. No other errors are ever returned.
-pub const StitchError = error{ OutputFileAlreadyExists, CouldNotOpenInputFile, CouldNotOpenOutputFile, InvalidExecutableFormat, ResourceNotFound, IoError };
+pub const StitchError = error{ OutputFileAlreadyExists, CouldNotOpenInputFile, CouldNotOpenOutputFile, InvalidExecutableFormat, ResourceNotFound, IoError, InvalidArgument };
 
 /// Diagnostic is available through `getDiagnostics` whenever an error is returned.
 pub const Diagnostic = union(std.meta.FieldEnum(StitchError)) {
@@ -82,6 +227,8 @@ pub const Diagnostic = union(std.meta.FieldEnum(StitchError)) {
     },
     // IO error description
     IoError: []const u8,
+    /// Reason an argument was rejected
+    InvalidArgument: []const u8,
 
     /// Print a diagnostic error to stderr
     pub fn print(self: Diagnostic, str_alloc: std.mem.Allocator) !void {
@@ -100,6 +247,7 @@ pub const Diagnostic = union(std.meta.FieldEnum(StitchError)) {
                 .index => return try std.fmt.allocPrint(str_alloc, "Resource index not found: {d}\n", .{self.ResourceNotFound.index}),
             },
             .IoError => return try std.fmt.allocPrint(str_alloc, "IO error: {s}\n", .{self.IoError}),
+            .InvalidArgument => return try std.fmt.allocPrint(str_alloc, "Invalid argument: {s}\n", .{self.InvalidArgument}),
         }
     }
 
@@ -114,15 +262,260 @@ pub const Diagnostic = union(std.meta.FieldEnum(StitchError)) {
     }
 };
 
+/// Counters kept by every session, returned by `getStats`. Durations are in nanoseconds.
+/// This is an extern struct, mirrored by `stitch_stats` in the C header.
+pub const Stats = extern struct {
+    /// Number of I/O operations issued: reads, writes, copies and maps of the executable, resource files, the output,
+    /// extracted files, and the temporary files of commit. This is approximate, since an operation can take several
+    /// system calls; a kernel copy is one operation however many calls it loops over.
+    syscalls: u64 = 0,
+    /// Bytes read from the executable, resource files and temporary files. In `mapped` mode, this includes bytes read
+    /// from the mapping. Bytes that pass through a temporary file during commit are counted again when read back.
+    bytes_read: u64 = 0,
+    /// Bytes written to the output, memory files, extracted files and temporary files
+    bytes_written: u64 = 0,
+    /// Time spent loading and parsing the index
+    index_load_ns: u64 = 0,
+    /// Resource lookups by name
+    lookups: u64 = 0,
+    /// Resource lookups by name that found no resource
+    lookup_misses: u64 = 0,
+    /// Memory reserved by the session arena
+    arena_bytes: u64 = 0,
+    /// Time spent copying the original executable on commit
+    commit_copy_ns: u64 = 0,
+    /// Time spent compressing resources on commit
+    commit_compress_ns: u64 = 0,
+    /// Time spent hashing resources for deduplication, reuse and checksums on commit
+    commit_hash_ns: u64 = 0,
+    /// Time spent writing the index and tail on commit
+    commit_index_ns: u64 = 0,
+    /// Time spent writing resource data on commit
+    commit_fill_ns: u64 = 0,
+    /// Total time spent in commit
+    commit_ns: u64 = 0,
+};
+
+/// Returns a snapshot of the session counters. This is safe to call from multiple threads.
+pub fn getStats(session: *Self) Stats {
+    var stats = Stats{};
+    inline for (std.meta.fields(Stats), 0..) |field, i| {
+        @field(stats, field.name) = session.counters[i].load(.monotonic);
+    }
+    session.mutex.lock();
+    defer session.mutex.unlock();
+    stats.arena_bytes = session.arena.queryCapacity();
+    return stats;
+}
+
+/// Whether trace spans are compiled in. Build with `zig build -Dtrace` to enable them.
+pub const tracing_enabled = build_options.trace;
+
+/// Start writing trace spans of commit and read phases to a Chrome trace JSON file at `path`, which can be opened
+/// in Perfetto or chrome://tracing. Without this call, spans are written to the file named by the `STITCH_TRACE`
+/// environment variable, if it's set when the first span ends. This does nothing unless `tracing_enabled`.
+pub fn startTrace(path: []const u8) !void {
+    if (!tracing_enabled) return;
+    tracer.mutex.lock();
+    defer tracer.mutex.unlock();
+    tracer.checked_env = true;
+    try openTraceFile(path);
+}
+
+/// Stop writing trace spans, and close the trace file, which is a complete JSON array after this.
+/// A trace file that isn't closed can still be opened, since trace viewers accept a missing closing bracket.
+pub fn stopTrace() void {
+    if (!tracing_enabled) return;
+    tracer.mutex.lock();
+    defer tracer.mutex.unlock();
+    if (tracer.file) |file| {
+        file.writeAll("\n]\n") catch {};
+        file.close();
+    }
+    tracer.file = null;
+}
+
+// Trace output, shared by all sessions in the process
+const tracer = struct {
+    var mutex: std.Thread.Mutex = .{};
+    var file: ?std.fs.File = null;
+    var events: u64 = 0;
+    /// Whether the `STITCH_TRACE` environment variable has been checked
+    var checked_env: bool = false;
+};
+
+// Replace the trace file. The tracer mutex must be held.
+fn openTraceFile(path: []const u8) !void {
+    const file = try std.fs.cwd().createFile(path, .{});
+    errdefer file.close();
+    try file.writeAll("[\n");
+    if (tracer.file) |previous| previous.close();
+    tracer.file = file;
+    tracer.events = 0;
+}
+
+/// A timed span of work, written as a Chrome trace "complete" event when it ends. This is an empty struct
+/// unless tracing is compiled in, so spans cost nothing in regular builds.
+const Span = if (tracing_enabled) struct {
+    name: []const u8,
+    /// Index of the resource the span works on, if any
+    resource: ?u64,
+    start: i128,
+
+    fn end(span: @This()) void {
+        writeTraceEvent(span.name, span.resource, span.start, std.time.nanoTimestamp());
+    }
+} else struct {
+    fn end(_: @This()) void {}
+};
+
+// Start a span, which is ended with `Span.end`
+fn beginSpan(comptime name: []const u8, resource: ?u64) Span {
+    return if (tracing_enabled) .{ .name = name, .resource = resource, .start = std.time.nanoTimestamp() } else .{};
+}
+
+fn writeTraceEvent(name: []const u8, resource: ?u64, start: i128, end: i128) void {
+    // Timestamps are in microseconds
+    const ts: u64 = @intCast(@max(start, 0));
+    const dur: u64 = @intCast(@max(end - start, 0));
+    const pid = if (builtin.os.tag == .linux) std.os.linux.getpid() else 0;
+    var buffer: [256]u8 = undefined;
+    var stream = std.io.fixedBufferStream(&buffer);
+    const out = stream.writer();
+    out.print("{{\"name\":\"{s}\",\"cat\":\"stitch\",\"ph\":\"X\",\"ts\":{d}.{d:0>3},\"dur\":{d}.{d:0>3},\"pid\":{d},\"tid\":{d}", .{
+        name, ts / 1000, ts % 1000, dur / 1000, dur % 1000, pid, std.Thread.getCurrentId(),
+    }) catch return;
+    if (resource) |index| out.print(",\"args\":{{\"resource\":{d}}}", .{index}) catch return;
+    out.writeByte('}') catch return;
+
+    tracer.mutex.lock();
+    defer tracer.mutex.unlock();
+    if (!tracer.checked_env) {
+        tracer.checked_env = true;
+        if (std.process.getEnvVarOwned(std.heap.page_allocator, "STITCH_TRACE")) |path| {
+            defer std.heap.page_allocator.free(path);
+            openTraceFile(path) catch {};
+        } else |_| {}
+    }
+    const file = tracer.file orelse return;
+    if (tracer.events > 0) file.writeAll(",\n") catch return;
+    file.writeAll(stream.getWritten()) catch return;
+    tracer.events += 1;
+}
+
+// Add to a session counter. This is safe to call from multiple threads.
+fn addStat(session: *Self, comptime counter: std.meta.FieldEnum(Stats), n: u64) void {
+    _ = session.counters[@intFromEnum(counter)].fetchAdd(n, .monotonic);
+}
+
+// Add the time elapsed since `start`, a `std.time.nanoTimestamp`, to a session counter
+fn addStatTime(session: *Self, comptime counter: std.meta.FieldEnum(Stats), start: i128) void {
+    session.addStat(counter, @intCast(@max(std.time.nanoTimestamp() - start, 0)));
+}
+
 /// It is guaranteed that if an error is returned by a public reader or writer session function,
 /// the diagnostic will be set. The diagnostic is reset to null at the beginning of each public function.
+/// Diagnostics are kept per thread, so this returns the diagnostic of the last call on the calling thread.
 pub fn getDiagnostics(session: *Self) ?Diagnostic {
-    return session.diagnostics orelse null;
+    const slot = thread_diagnostics.find(session.id) orelse return null;
+    return slot.diagnostic;
 }
 
 // Called by all API functions to ensure that diagnostics is set only if a StitchError occurs
 fn resetDiagnostics(session: *Self) void {
-    session.diagnostics = null;
+    session.setDiagnostics(null);
+}
+
+// Set the calling thread's diagnostics. This is safe to call from multiple threads.
+fn setDiagnostics(session: *Self, diagnostics: ?Diagnostic) void {
+    if (diagnostics) |diagnostic| {
+        thread_diagnostics.put(session.id, diagnostic);
+    } else {
+        thread_diagnostics.remove(session.id);
+    }
+}
+
+// Source of session ids. 0 marks a free diagnostic slot, so ids start at 1.
+var next_session_id = std.atomic.Value(u64).init(1);
+
+fn nextSessionId() u64 {
+    return next_session_id.fetchAdd(1, .monotonic);
+}
+
+// Diagnostics of the sessions that failed a call on this thread. Being thread-local, they need no lock, and
+// since nothing is allocated, setting a diagnostic can't fail. A thread that interleaves failing calls on more
+// sessions than there are slots loses the oldest diagnostic first.
+threadlocal var thread_diagnostics: ThreadDiagnostics = .{};
+
+const ThreadDiagnostics = struct {
+    const Slot = struct {
+        session_id: u64 = 0,
+        diagnostic: Diagnostic = undefined,
+    };
+
+    slots: [8]Slot = [_]Slot{.{}} ** 8,
+    // Slot replaced by the next diagnostic when none is free
+    next_victim: usize = 0,
+    // Number of slots in use, so the common case of a thread without failures is a single comparison
+    used: usize = 0,
+
+    fn find(self: *ThreadDiagnostics, session_id: u64) ?*Slot {
+        if (self.used == 0) return null;
+        for (&self.slots) |*slot| {
+            if (slot.session_id == session_id) return slot;
+        }
+        return null;
+    }
+
+    fn put(self: *ThreadDiagnostics, session_id: u64, diagnostic: Diagnostic) void {
+        const slot = self.find(session_id) orelse blk: {
+            if (self.used == self.slots.len) {
+                const victim = &self.slots[self.next_victim];
+                self.next_victim = (self.next_victim + 1) % self.slots.len;
+                break :blk victim;
+            }
+            self.used += 1;
+            for (&self.slots) |*free| {
+                if (free.session_id == 0) break :blk free;
+            }
+            unreachable;
+        };
+        slot.* = .{ .session_id = session_id, .diagnostic = diagnostic };
+    }
+
+    fn remove(self: *ThreadDiagnostics, session_id: u64) void {
+        const slot = self.find(session_id) orelse return;
+        slot.session_id = 0;
+        self.used -= 1;
+    }
+};
+
+// Allocate session memory. This is safe to call from multiple threads.
+fn allocShared(session: *Self, len: u64) ![]u8 {
+    session.mutex.lock();
+    defer session.mutex.unlock();
+    return session.arena.allocator().alloc(u8, len);
+}
+
+// Allocate a resource reader for a C stream handle, which outlives any single call. This is safe to call from multiple threads.
+fn createStream(session: *Self) ?*StitchResourceReader {
+    session.mutex.lock();
+    defer session.mutex.unlock();
+    return session.arena.child_allocator.create(StitchResourceReader) catch null;
+}
+
+// Free a resource reader allocated by `createStream`
+fn destroyStream(session: *Self, stream: *StitchResourceReader) void {
+    session.mutex.lock();
+    defer session.mutex.unlock();
+    session.arena.child_allocator.destroy(stream);
+}
+
+// Same as `allocShared`, aligned for version 2 index records
+fn allocSharedAligned(session: *Self, len: u64) ![]align(@alignOf(IndexRecord)) u8 {
+    session.mutex.lock();
+    defer session.mutex.unlock();
+    return session.arena.allocator().alignedAlloc(u8, @alignOf(IndexRecord), len);
 }
 
 /// Intialize a stitch session for writing.
@@ -132,6 +525,7 @@ pub fn initWriter(allocator: std.mem.Allocator, input_executable_path: []const u
     var session = try allocator.create(Self);
     errdefer allocator.destroy(session);
     session.* = .{
+        .id = nextSessionId(),
         .arena = std.heap.ArenaAllocator.init(allocator),
     };
     const arena_allocator = session.arena.allocator();
@@ -142,7 +536,7 @@ pub fn initWriter(allocator: std.mem.Allocator, input_executable_path: []const u
 
     // Output path does not need to exists; since we use cwd().createFile, path doesn't need to be absolute
     // We still attempt realpath to detect if we're stitching on the original
-    const absolute_output_path = realpathOrOriginal(arena_allocator, output_executable_path) catch return StitchError.CouldNotOpenOutputFile;
+    var absolute_output_path = realpathOrOriginal(arena_allocator, output_executable_path) catch return StitchError.CouldNotOpenOutputFile;
     const stitch_to_original = std.mem.eql(u8, absolute_input_path, absolute_output_path);
 
     if (!stitch_to_original) {
@@ -152,12 +546,102 @@ pub fn initWriter(allocator: std.mem.Allocator, input_executable_path: []const u
             },
             else => return err,
         };
+        // Now that the output exists, resolve it so temporary files go next to it wherever the cwd moves
+        absolute_output_path = try std.fs.realpathAlloc(arena_allocator, absolute_output_path);
     }
 
-    session.rw = .{ .writer = StitchWriter.init(session) };
+    session.rw = .{ .writer = StitchWriter.init(session, absolute_input_path) };
+    session.rw.writer.spool_dir = std.fs.path.dirname(absolute_output_path) orelse ".";
+    return session.rw.writer;
+}
+
+/// Intialize a stitch session that writes to a stream rather than a file, such as stdout, a pipe or a socket.
+/// This returns a `StitchWriter`, whose output is written with `StitchWriter.commitToStream`. The input executable is only read.
+pub fn initWriterToStream(allocator: std.mem.Allocator, input_executable_path: []const u8) !StitchWriter {
+    var session = try allocator.create(Self);
+    errdefer allocator.destroy(session);
+    session.* = .{
+        .id = nextSessionId(),
+        .arena = std.heap.ArenaAllocator.init(allocator),
+    };
+    errdefer session.arena.deinit();
+
+    const absolute_input_path = std.fs.realpathAlloc(session.arena.allocator(), input_executable_path) catch return StitchError.CouldNotOpenInputFile;
+    session.org_exe_file = std.fs.openFileAbsolute(absolute_input_path, .{ .mode = .read_only }) catch return StitchError.CouldNotOpenInputFile;
+
+    session.rw = .{ .writer = StitchWriter.init(session, absolute_input_path) };
+    session.rw.writer.spool_dir = tempDirPath(session.arena.allocator());
     return session.rw.writer;
 }
 
+// Directory for the temporary files of sessions that have no output file
+fn tempDirPath(allocator: std.mem.Allocator) []const u8 {
+    for ([_][]const u8{ "TMPDIR", "TEMP", "TMP" }) |name| {
+        if (std.process.getEnvVarOwned(allocator, name)) |path| return path else |_| {}
+    }
+    return if (builtin.os.tag == .windows) "." else "/tmp";
+}
+
+/// Options for `initStreamingWriter`. Except for compression, these apply to every resource, so they're fixed
+/// when the writer is created.
+pub const StreamingWriterOptions = struct {
+    /// Format version to write. See `StitchWriter.setFormatVersion`
+    format_version: u8 = StitchVersion,
+    /// Alignment of resource data in the output, which must be a power of two. See `StitchWriter.setAlignment`
+    alignment: u64 = 1,
+    /// Record a CRC-32C checksum of every resource's stored bytes. See `StitchWriter.setChecksums`
+    checksums: bool = false,
+    /// Record a BLAKE3 digest of every resource's uncompressed content. See `StitchWriter.setContentDigests`
+    content_digests: bool = false,
+    /// Compression of added resources, which can be changed with `StitchStreamingWriter.setCompression`
+    compression: Codec = .none,
+    /// Bytes of index entries, of names, and of the compressed chunks of a resource kept in memory.
+    /// Past this, they're moved to temporary files next to the output.
+    spill_limit: usize = 1024 * 1024,
+};
+
+/// Intialize a stitch session that writes resources as they're added.
+/// This returns a `StitchStreamingWriter`, which copies the input executable to the output right away and writes each
+/// resource as soon as it's added, keeping only a compact index entry per resource. Entries, names, and the compressed
+/// chunks of a `deflate_chunked` resource (whose chunk table is stored before them) are moved to temporary files past
+/// `spill_limit`. Memory use therefore doesn't grow with the number of resources, and only grows with the size of a
+/// `deflate_chunked` resource by 8 bytes per chunk. `commit` only appends the index and tail.
+/// The input and output paths can be the same, in which case a previous payload is overwritten as resources are added.
+/// Its tail is invalidated when the writer is created, so readers reject the executable until `commit` returns,
+/// rather than trust an index whose resources are being overwritten.
+pub fn initStreamingWriter(allocator: std.mem.Allocator, input_executable_path: []const u8, output_executable_path: []const u8, options: StreamingWriterOptions) !StitchStreamingWriter {
+    if (options.format_version < 1 or options.format_version > LatestStitchVersion) return StitchError.InvalidArgument;
+    if (!std.math.isPowerOfTwo(options.alignment)) return StitchError.InvalidArgument;
+
+    const writer = try initWriter(allocator, input_executable_path, output_executable_path);
+    const session = writer.session;
+    errdefer session.deinit();
+    const outfile = session.output_exe_file orelse session.org_exe_file;
+
+    const exe_file_len = try session.executableLength(writer.input_path);
+    if (session.output_exe_file != null) {
+        const copy_start = std.time.nanoTimestamp();
+        defer session.addStatTime(.commit_copy_ns, copy_start);
+        const span = beginSpan("copy executable", null);
+        defer span.end();
+        try session.copyFileRange(session.org_exe_file, 0, outfile, 0, exe_file_len);
+    } else if (exe_file_len < try outfile.getEndPos()) {
+        // Resources are written over the previous payload as they're added, so its tail is invalidated first
+        try session.invalidateTail(outfile);
+    }
+
+    session.rw = .{ .streaming_writer = .{
+        .session = session,
+        .outfile = outfile,
+        .options = options,
+        .codec = options.compression,
+        .exe_file_len = exe_file_len,
+        .offset = exe_file_len,
+        .spill_dir = writer.spool_dir,
+    } };
+    return session.rw.streaming_writer;
+}
+
 /// Same as realpathAlloc, except it returns the original path if the path
 /// doesn't exist rather than an error
 fn realpathOrOriginal(allocator: std.mem.Allocator, path: []const u8) ![]const u8 {
@@ -170,185 +654,1343 @@ fn realpathOrOriginal(allocator: std.mem.Allocator, path: []const u8) ![]const u
     };
 }
 
+/// How a reader session accesses the executable
+pub const ReadMode = enum {
+    /// The executable is memory-mapped once. Resource slices point directly into the mapping, so no
+    /// memory is allocated or copied, and the pages are shared by all processes running the same binary.
+    /// If the platform or file doesn't support mapping, the session silently falls back to `file` mode.
+    mapped,
+    /// Resources are read with regular file I/O into memory owned by the session
+    file,
+};
+
+/// Options for `initReaderWithOptions`
+pub const ReaderOptions = struct {
+    mode: ReadMode = .mapped,
+    /// Verify resources against the checksums in the index as they're read. Reading a corrupt resource
+    /// then fails, rather than returning bad data. See `StitchWriter.setChecksums`
+    verify: bool = false,
+    /// Only read the tail and the index header when the session is initialized, and load the index on the first
+    /// resource lookup. This makes opening executables with large indices nearly free when few or no resources are read.
+    /// The header is the resource count, and the alignment and executable length extensions; version 1 entries
+    /// have variable lengths, so finding the extensions reads through a version 1 index once, without keeping it.
+    /// `getFormatVersion`, `getResourceCount` and `getResourceAlignment` never load the index. A corrupt entry
+    /// in a version 2 index is then reported by the first lookup rather than by `initReader`.
+    lazy_index: bool = false,
+};
+
 /// Intialize a stitch session for reading
 /// This returns a StitchReader, which can be used to read resources from the executable
 /// If path is null, the currently running executable will be used
 pub fn initReader(allocator: std.mem.Allocator, path: ?[]const u8) !StitchReader {
+    return initReaderWithOptions(allocator, path, .{});
+}
+
+/// Same as `initReader`, with control over how the executable is accessed
+pub fn initReaderWithOptions(allocator: std.mem.Allocator, path: ?[]const u8, options: ReaderOptions) !StitchReader {
     var session = try allocator.create(Self);
     errdefer allocator.destroy(session);
     session.* = .{
+        .id = nextSessionId(),
         .arena = std.heap.ArenaAllocator.init(allocator),
-        .rw = .{ .reader = StitchReader.init(session) },
     };
     errdefer session.arena.deinit();
+    session.rw = .{ .reader = try StitchReader.init(session) };
 
     if (path) |_| {
         session.org_exe_file = try std.fs.openFileAbsolute(
-            try std.fs.realpathAlloc(allocator, path.?),
+            try std.fs.realpathAlloc(session.arena.allocator(), path.?),
             .{ .mode = .read_only },
         );
     } else {
         session.org_exe_file = try std.fs.openSelfExe(.{ .mode = .read_only });
     }
+    errdefer session.org_exe_file.close();
+
+    if (options.mode == .mapped) session.mapExecutable();
+    session.rw.reader.verify = options.verify;
+    errdefer if (session.mapped_exe) |mapped| std.os.munmap(mapped);
+
+    if (options.lazy_index) {
+        session.rw.reader.lazy = true;
+        try session.rw.reader.readTail();
+        try session.rw.reader.readIndexHeader();
+    } else {
+        try session.rw.reader.readMetadata();
+    }
+    return session.rw.reader;
+}
+
+/// Returns a reader session for the currently running executable, which shares the loaded index, file handle and
+/// mapping with every other session returned by this function in the process. The shared state is loaded by the
+/// first call and freed when the last of these sessions is closed, so opening the executable from many components
+/// costs a single index parse. Each session still has its own memory and diagnostics, and is closed with `deinit`.
+/// This is safe to call from multiple threads.
+pub fn initSharedSelfReader(allocator: std.mem.Allocator) !StitchReader {
+    return initSharedReader(allocator, null);
+}
+
+// Same as `initSharedSelfReader`, except the shared session is opened on `path` if it isn't open yet.
+// A null path is the running executable; tests use a stitched fixture.
+fn initSharedReader(allocator: std.mem.Allocator, path: ?[]const u8) !StitchReader {
+    const shared = try acquireSelfReader(path);
+    errdefer releaseSelfReader(shared);
+
+    var session = try allocator.create(Self);
+    session.* = .{
+        .id = nextSessionId(),
+        .arena = std.heap.ArenaAllocator.init(allocator),
+        .org_exe_file = shared.org_exe_file,
+        .mapped_exe = shared.mapped_exe,
+        .shared = shared,
+    };
 
-    try session.rw.reader.readMetadata();
+    // The copied reader points at the index in the shared session's memory, which is never modified once loaded
+    session.rw = .{ .reader = shared.rw.reader };
+    session.rw.reader.session = session;
     return session.rw.reader;
 }
 
+// Reader session for the running executable, shared by the sessions returned from `initSharedSelfReader`
+var self_reader: struct {
+    mutex: std.Thread.Mutex = .{},
+    session: ?*Self = null,
+    ref_count: usize = 0,
+} = .{};
+
+// Returns the shared self reader session, opening it on `path` if there's none, and adds a reference to it
+fn acquireSelfReader(path: ?[]const u8) !*Self {
+    self_reader.mutex.lock();
+    defer self_reader.mutex.unlock();
+    if (self_reader.session == null) {
+        const allocator = if (builtin.link_libc) std.heap.c_allocator else std.heap.page_allocator;
+        const reader = try initReader(allocator, path);
+        self_reader.session = reader.session;
+    }
+    self_reader.ref_count += 1;
+    return self_reader.session.?;
+}
+
+// Drops a reference to the shared self reader session, closing it when the last reference is dropped
+fn releaseSelfReader(shared: *Self) void {
+    self_reader.mutex.lock();
+    defer self_reader.mutex.unlock();
+    self_reader.ref_count -= 1;
+    if (self_reader.ref_count == 0) {
+        shared.deinit();
+        self_reader.session = null;
+    }
+}
+
+// Map the entire executable read-only. Failing to map is not an error; the session then uses file I/O.
+fn mapExecutable(session: *Self) void {
+    if (builtin.os.tag == .windows or builtin.os.tag == .wasi) return;
+    const len = session.org_exe_file.getEndPos() catch return;
+    if (len == 0) return;
+    session.mapped_exe = std.os.mmap(null, len, std.os.PROT.READ, .{ .TYPE = .PRIVATE }, session.org_exe_file.handle, 0) catch return;
+    session.addStat(.syscalls, 1);
+}
+
+// Length of the input executable without any payload already stitched to it, which is replaced rather than nested
+fn executableLength(session: *Self, input_path: []const u8) !u64 {
+    var len = try session.org_exe_file.getEndPos();
+    if (initReaderWithOptions(session.arena.child_allocator, input_path, .{ .mode = .file })) |reader| {
+        var previous = reader;
+        defer previous.deinit();
+        len = previous.getPayloadOffset() catch len;
+    } else |_| {}
+    return len;
+}
+
+// Clear the end-of-file magic of the payload already stitched to `outfile`, so readers reject the file
+// rather than trust an index whose resources are being overwritten
+fn invalidateTail(session: *Self, outfile: std.fs.File) !void {
+    const len = try outfile.getEndPos();
+    if (len < 8) return;
+    session.addStat(.syscalls, 1);
+    session.addStat(.bytes_written, 8);
+    try outfile.pwriteAll(&[_]u8{0} ** 8, len - 8);
+}
+
 // Called by a reader or writer's deinit function to free the session resources
 fn deinit(session: *Self) void {
-    session.org_exe_file.close();
+    thread_diagnostics.remove(session.id);
+    if (session.shared) |shared| {
+        releaseSelfReader(shared);
+    } else {
+        if (session.mapped_exe) |mapped| std.os.munmap(mapped);
+        session.org_exe_file.close();
+    }
     if (session.output_exe_file) |f| f.close();
     var child_allocator = session.arena.child_allocator;
+    while (session.reader_memory) |memory| {
+        session.reader_memory = memory.next;
+        memory.free(child_allocator);
+    }
     session.arena.deinit();
     child_allocator.destroy(session);
 }
 
-/// Use `initWriter` to create this writer, which allows you to append resources to an executable in
-/// a format recognized by `StitchReader`
-pub const StitchWriter = struct {
-    session: *Self = undefined,
-    exe: StitchExecutable = undefined,
+/// Copy `len` bytes from `in` at `in_offset` to `out` at `out_offset`, letting the kernel do the work.
+/// A whole-file copy to the start of `out` is first attempted as a reflink, which completes
+/// almost instantly on filesystems that share extents, such as btrfs and xfs.
+/// Otherwise copy_file_range is used, which falls back to large-block positional reads and writes
+/// where the kernel can't copy between the two files. File cursors are not moved.
+fn copyFileRange(session: *Self, in: std.fs.File, in_offset: u64, out: std.fs.File, out_offset: u64, len: u64) !void {
+    if (len == 0) return;
+    session.addStat(.syscalls, 1);
+    session.addStat(.bytes_read, len);
+    session.addStat(.bytes_written, len);
+    if (in_offset == 0 and out_offset == 0 and len == try in.getEndPos() and reflink(in, out)) return;
+    if (try in.copyRangeAll(in_offset, out, out_offset, len) != len) return error.EndOfStream;
+}
 
-    fn init(session: *Self) StitchWriter {
-        return .{
-            .session = session,
-            .exe = .{
-                .resources = std.ArrayList(Resource).init(session.arena.allocator()),
-                .index = .{ .entries = std.ArrayList(IndexEntry).init(session.arena.allocator()) },
-                .tail = .{ .index_offset = 0, .version = 0, .eof_magic = EofMagic },
-            },
-        };
+/// CRC-32C (Castagnoli) of `bytes`, continuing from `crc`, which is 0 for the first call.
+/// Uses the CPU's CRC instructions when it has them (SSE 4.2 on x86-64, the CRC extension on AArch64),
+/// which checksum 8 bytes per instruction at several GB/s, and slicing-by-8 tables otherwise.
+/// On x86-64, the instructions are detected at runtime, so baseline builds use them too. On AArch64,
+/// they're only used when the build target has the CRC extension.
+fn crc32c(crc: u32, bytes: []const u8) u32 {
+    if (builtin.cpu.arch == .x86_64 and hasSse42()) {
+        var state: u64 = ~crc;
+        var i: usize = 0;
+        while (i + 8 <= bytes.len) : (i += 8) {
+            state = asm ("crc32q %[word], %[state]"
+                : [state] "=r" (-> u64),
+                : [word] "r" (std.mem.readInt(u64, bytes[i..][0..8], .little)),
+                  [state_in] "0" (state),
+            );
+        }
+        var state32: u32 = @truncate(state);
+        while (i < bytes.len) : (i += 1) {
+            state32 = asm ("crc32b %[byte], %[state]"
+                : [state] "=r" (-> u32),
+                : [byte] "r" (bytes[i]),
+                  [state_in] "0" (state32),
+            );
+        }
+        return ~state32;
+    }
+    if (builtin.cpu.arch == .aarch64 and std.Target.aarch64.featureSetHas(builtin.cpu.features, .crc)) {
+        var state: u32 = ~crc;
+        var i: usize = 0;
+        while (i + 8 <= bytes.len) : (i += 8) {
+            state = asm ("crc32cx %w[ret], %w[state], %x[word]"
+                : [ret] "=r" (-> u32),
+                : [state] "r" (state),
+                  [word] "r" (std.mem.readInt(u64, bytes[i..][0..8], .little)),
+            );
+        }
+        while (i < bytes.len) : (i += 1) {
+            state = asm ("crc32cb %w[ret], %w[state], %w[byte]"
+                : [ret] "=r" (-> u32),
+                : [state] "r" (state),
+                  [byte] "r" (@as(u32, bytes[i])),
+            );
+        }
+        return ~state;
     }
 
-    /// Closes the stitch session and frees all resources.
-    /// This must be called to ensure the writer session is properly closed.
-    pub fn deinit(writer: *StitchWriter) void {
-        writer.session.deinit();
+    // Slicing-by-8: each step folds 8 bytes into the state with 8 independent table lookups
+    const tables = &crc32c_tables;
+    var state: u32 = ~crc;
+    var i: usize = 0;
+    while (i + 8 <= bytes.len) : (i += 8) {
+        const lo = std.mem.readInt(u32, bytes[i..][0..4], .little) ^ state;
+        const hi = std.mem.readInt(u32, bytes[i + 4 ..][0..4], .little);
+        state = tables[7][lo & 0xff] ^ tables[6][(lo >> 8) & 0xff] ^ tables[5][(lo >> 16) & 0xff] ^ tables[4][lo >> 24] ^
+            tables[3][hi & 0xff] ^ tables[2][(hi >> 8) & 0xff] ^ tables[1][(hi >> 16) & 0xff] ^ tables[0][hi >> 24];
     }
+    while (i < bytes.len) : (i += 1) {
+        state = tables[0][(state ^ bytes[i]) & 0xff] ^ (state >> 8);
+    }
+    return ~state;
+}
 
-    /// Write original executable, index, resources, and tail to output file.
-    pub fn commit(writer: *StitchWriter) StitchError!void {
-        // Wrapper to reclassify errors into StitchError.IoError
-        return commitImpl(writer) catch |err| {
-            if (!Diagnostic.isDiagnostic(err)) {
-                writer.session.diagnostics = .{ .IoError = "Unable to commit resources to output file" };
-                return StitchError.IoError;
-            }
-            return @as(StitchError, @errorCast(err));
-        };
+// Lookup tables of the slicing-by-8 CRC-32C. Table k gives the CRC of a byte followed by k zero bytes.
+const crc32c_tables: [8][256]u32 = blk: {
+    @setEvalBranchQuota(20000);
+    var tables: [8][256]u32 = undefined;
+    for (0..256) |n| {
+        var c: u32 = n;
+        for (0..8) |_| c = if (c & 1 != 0) (c >> 1) ^ 0x82f63b78 else c >> 1;
+        tables[0][n] = c;
+    }
+    for (1..8) |k| {
+        for (0..256) |n| {
+            const prev = tables[k - 1][n];
+            tables[k][n] = (prev >> 8) ^ tables[0][prev & 0xff];
+        }
     }
+    break :blk tables;
+};
 
-    fn commitImpl(writer: *StitchWriter) !void {
-        writer.session.resetDiagnostics();
-        var outfile = writer.session.output_exe_file orelse writer.session.org_exe_file;
-        var buffered_writer = std.io.bufferedWriter(outfile.writer());
-        var counting_writer = std.io.countingWriter(buffered_writer.writer());
-        var stream = counting_writer.writer();
+// Whether the CPU has the SSE 4.2 CRC instructions. Unless the build target guarantees them, this asks cpuid
+// once and caches the answer; racing threads compute the same value.
+fn hasSse42() bool {
+    if (comptime std.Target.x86.featureSetHas(builtin.cpu.features, .crc32)) return true;
+    const Cache = struct {
+        var state = std.atomic.Value(u8).init(0);
+    };
+    switch (Cache.state.load(.monotonic)) {
+        1 => return true,
+        2 => return false,
+        else => {},
+    }
+    var ecx: u32 = undefined;
+    asm volatile ("cpuid"
+        : [_] "={ecx}" (ecx),
+        : [_] "{eax}" (@as(u32, 1)),
+          [_] "{ecx}" (@as(u32, 0)),
+        : "eax", "ebx", "edx"
+    );
+    // CPUID leaf 1 reports SSE 4.2 in bit 20 of ECX
+    const has_sse42 = ecx & (1 << 20) != 0;
+    Cache.state.store(if (has_sse42) 1 else 2, .monotonic);
+    return has_sse42;
+}
 
-        // Write original executable if we're not stitching to the original, otherwise seek to the end of original
-        if (writer.session.output_exe_file != null) {
-            var buffered_reader = std.io.bufferedReader(writer.session.org_exe_file.reader());
-            try copyBytes(buffered_reader.reader(), buffered_writer.writer());
+/// Make `out` share the extents of `in`. Returns false if the filesystem or OS doesn't support it.
+fn reflink(in: std.fs.File, out: std.fs.File) bool {
+    if (builtin.os.tag == .linux) {
+        const linux = std.os.linux;
+        const FICLONE = linux.IOCTL.IOW(0x94, 9, c_int);
+        return linux.getErrno(linux.ioctl(out.handle, FICLONE, @as(usize, @intCast(in.handle)))) == .SUCCESS;
+    }
+    return false;
+}
 
-            // Flush to ensure the file length is correct when queried
-            try buffered_writer.flush();
-        } else {
-            try outfile.seekFromEnd(0);
-        }
+/// Where and how a resource is written. Commit computes this for every resource before writing any resource data.
+const Placement = struct {
+    /// Offset of the resource magic in the output
+    offset: u64 = 0,
+    /// Number of stored bytes following the resource magic
+    length: u64 = 0,
+    uncompressed_length: u64 = 0,
+    /// Bytes to write, for resources added from a slice
+    data: ?[]const u8 = null,
+    /// Where the stored bytes are in the commit spool, for compressed resources and readers that aren't regular files.
+    /// Otherwise the data is copied from the source file.
+    segments: ?[]const SpoolSegment = null,
+    /// Where the data starts in the source file of a reader resource
+    source_offset: u64 = 0,
+    /// Whether the stored bytes must be hashed to find duplicates
+    needs_digest: bool = false,
+    digest: [Blake3.digest_length]u8 = undefined,
+    /// Index of another resource with identical stored bytes, whose data this resource shares
+    duplicate_of: ?usize = null,
+    /// When stitching to the original, the offset of a resource in the previous payload with the same name and stored length
+    previous_offset: ?u64 = null,
+    previous_digest: [Blake3.digest_length]u8 = undefined,
+    /// Whether the resource is identical to the one at `previous_offset` and is left in place
+    reused: bool = false,
+    /// BLAKE3 digest of the uncompressed resource. This is set if content digests are written.
+    content_digest: [Blake3.digest_length]u8 = undefined,
+    /// CRC-32C of the stored bytes. This is set if checksums are written.
+    checksum: u32 = 0,
+};
 
-        // No resources = write empty tail
-        if (writer.exe.resources.items.len == 0) {
-            try stream.writeInt(u64, 0, .big);
-            try stream.writeByte(StitchVersion);
-            try stream.writeInt(u64, EofMagic, .big);
-            try buffered_writer.flush();
-            return;
-        }
+/// Feeds the stored bytes of a resource to the hashes it needs, so they're computed in a single pass
+const StoredBytesHasher = struct {
+    digest: ?Blake3,
+    checksum: ?u32,
 
-        // This is zero if we're writing not stitching to the original.
-        // In that case, we set this when we know the length of the first input (which must be the executable)
-        const exe_file_len = try outfile.getEndPos();
+    fn update(hasher: *StoredBytesHasher, bytes: []const u8) void {
+        if (hasher.digest) |*digest| digest.update(bytes);
+        if (hasher.checksum) |*checksum| checksum.* = crc32c(checksum.*, bytes);
+    }
+};
 
-        // Keeps track of offsets relative to the end of th original executable
-        // This is used to compute resource indices
-        var resource_offsets = std.ArrayList(u64).init(writer.session.arena.allocator());
-        try resource_offsets.append(exe_file_len);
-        var resource_lengths = std.ArrayList(u64).init(writer.session.arena.allocator());
+/// Range of the commit spool holding part of a resource's stored bytes
+const SpoolSegment = struct {
+    offset: u64,
+    len: u64,
+};
 
-        // Append resources, each prefixed with resource magic
-        for (writer.exe.resources.items) |*item| {
-            const written_before = counting_writer.bytes_written;
-            try stream.writeInt(u64, ResourceMagic, .big);
-            switch (item.data) {
-                .bytes => {
-                    try stream.writeAll(item.data.bytes);
-                },
-                .reader => {
-                    try copyBytes(item.data.reader, stream);
-                },
-                .path => {
-                    var file = std.fs.cwd().openFile(item.data.path, .{ .mode = .read_only }) catch |err| switch (err) {
-                        std.fs.File.OpenError.FileNotFound => {
-                            writer.session.diagnostics = .{ .CouldNotOpenInputFile = item.data.path };
-                            return StitchError.CouldNotOpenInputFile;
-                        },
-                        else => return err,
-                    };
-                    defer file.close();
-                    try copyBytes(file.reader(), stream);
-                },
+/// Temporary file holding stored bytes that commit can't read from a source when the layout is known: compressed
+/// resources, and readers that aren't regular files. Jobs append to it concurrently, a segment at a time, so memory
+/// use doesn't depend on the size of these resources. The file is created on the first append.
+const Spool = struct {
+    /// Directory of the temporary file
+    dir: []const u8,
+    file: ?std.fs.File = null,
+    path: []const u8 = "",
+    len: u64 = 0,
+    mutex: std.Thread.Mutex = .{},
+
+    // Reserve space at the end of the spool and write `bytes` there, returning their offset.
+    // `allocator` must be thread-safe.
+    fn append(spool: *Spool, session: *Self, allocator: std.mem.Allocator, bytes: []const u8) !u64 {
+        const offset = reserve: {
+            spool.mutex.lock();
+            defer spool.mutex.unlock();
+            if (spool.file == null) {
+                const name = try generateUniqueFileName(allocator);
+                spool.path = try std.fs.path.join(allocator, &.{ spool.dir, name });
+                spool.file = try std.fs.cwd().createFile(spool.path, .{ .read = true, .exclusive = true });
             }
-            try resource_offsets.append(exe_file_len + counting_writer.bytes_written);
-            try resource_lengths.append(counting_writer.bytes_written - written_before - 8);
+            spool.len += bytes.len;
+            break :reserve spool.len - bytes.len;
+        };
+        session.addStat(.syscalls, 1);
+        session.addStat(.bytes_written, bytes.len);
+        try spool.file.?.pwriteAll(bytes, offset);
+        return offset;
+    }
+
+    fn deinit(spool: *Spool) void {
+        if (spool.file) |file| {
+            file.close();
+            std.fs.cwd().deleteFile(spool.path) catch {};
         }
+        spool.file = null;
+    }
+};
 
-        const index_offset = exe_file_len + counting_writer.bytes_written;
+/// Writes the stored bytes of one resource to the spool through a fixed-size buffer. Segments that turn out
+/// to be contiguous are merged, so a resource that isn't interleaved with others is a single segment.
+const SpoolWriter = struct {
+    spool: *Spool,
+    session: *Self,
+    /// Thread-safe allocator for the segment list
+    allocator: std.mem.Allocator,
+    segments: std.ArrayListUnmanaged(SpoolSegment) = .{},
+    buffer: [64 * 1024]u8 = undefined,
+    end: usize = 0,
+    /// Number of bytes written
+    len: u64 = 0,
 
-        // Write the index
-        try stream.writeInt(u64, writer.exe.index.entries.items.len, .big);
-        for (writer.exe.index.entries.items, 0..) |*entry, i| {
-            try stream.writeInt(u64, entry.name.len, .big);
-            try stream.writeAll(entry.name);
-            try stream.writeByte(entry.resource_type);
-            try stream.writeInt(u64, resource_offsets.items[i], .big);
-            try stream.writeInt(u64, resource_lengths.items[i], .big);
-            try stream.writeAll(&entry.scratch_bytes);
-        }
+    const Writer = std.io.Writer(*SpoolWriter, anyerror, write);
 
-        // Write the tail
-        try stream.writeInt(u64, index_offset, .big);
-        try stream.writeByte(StitchVersion);
-        try stream.writeInt(u64, EofMagic, .big);
-        try buffered_writer.flush();
-    }
-
-    // Copy bytes from a reader to a writer, until EOF
-    fn copyBytes(reader: anytype, writer: anytype) !void {
-        var buffered_reader = std.io.bufferedReader(reader);
-        var instream = buffered_reader.reader();
-        read_loop: while (true) {
-            const byte = instream.readByte() catch |err| switch (err) {
-                error.EndOfStream => break :read_loop,
-                else => return err,
-            };
-            try writer.writeByte(byte);
+    fn write(out: *SpoolWriter, bytes: []const u8) anyerror!usize {
+        if (out.end == out.buffer.len) try out.flush();
+        const len = @min(bytes.len, out.buffer.len - out.end);
+        @memcpy(out.buffer[out.end..][0..len], bytes[0..len]);
+        out.end += len;
+        out.len += len;
+        return len;
+    }
+
+    fn writer(out: *SpoolWriter) Writer {
+        return .{ .context = out };
+    }
+
+    // Copy `reader` to the spool until it ends, reading directly into the buffer
+    fn pump(out: *SpoolWriter, reader: anytype) !void {
+        while (true) {
+            if (out.end == out.buffer.len) try out.flush();
+            const bytes_read = try reader.read(out.buffer[out.end..]);
+            out.session.addStat(.syscalls, 1);
+            out.session.addStat(.bytes_read, bytes_read);
+            if (bytes_read == 0) break;
+            out.end += bytes_read;
+            out.len += bytes_read;
         }
     }
 
-    /// Set the scratch bytes for a resource, using the index returned by the addResource... functions.
-    /// The default scratch bytes is all-zero.
-    pub fn setScratchBytes(writer: *StitchWriter, resource_index: u64, bytes: [8]u8) StitchError!void {
-        writer.session.resetDiagnostics();
-        if (resource_index >= writer.exe.index.entries.items.len) {
-            writer.session.diagnostics = .{ .ResourceNotFound = .{ .index = resource_index } };
-            return StitchError.ResourceNotFound;
+    fn flush(out: *SpoolWriter) !void {
+        if (out.end == 0) return;
+        const offset = try out.spool.append(out.session, out.allocator, out.buffer[0..out.end]);
+        const segments = out.segments.items;
+        if (segments.len > 0 and segments[segments.len - 1].offset + segments[segments.len - 1].len == offset) {
+            segments[segments.len - 1].len += out.end;
+        } else {
+            try out.segments.append(out.allocator, .{ .offset = offset, .len = out.end });
         }
-        writer.exe.index.entries.items[resource_index].scratch_bytes = bytes;
+        out.end = 0;
     }
+};
 
-    /// Reads the file at `path` and adds it to the list of resources to be written
-    /// This option has minimal memory overhead
+/// Reads stored bytes back from spool segments with positional reads
+const SpoolReader = struct {
+    spool: *const Spool,
+    segments: []const SpoolSegment,
+    session: *Self,
+    /// Index of the segment read next, and the position within it
+    segment: usize = 0,
+    pos: u64 = 0,
+
+    const Reader = std.io.Reader(*SpoolReader, std.fs.File.PReadError, read);
+
+    fn read(in: *SpoolReader, dest: []u8) std.fs.File.PReadError!usize {
+        while (in.segment < in.segments.len and in.pos == in.segments[in.segment].len) {
+            in.segment += 1;
+            in.pos = 0;
+        }
+        if (in.segment == in.segments.len) return 0;
+        const segment = in.segments[in.segment];
+        const len: usize = @intCast(@min(dest.len, segment.len - in.pos));
+        const bytes_read = try in.spool.file.?.pread(dest[0..len], segment.offset + in.pos);
+        in.session.addStat(.syscalls, 1);
+        in.session.addStat(.bytes_read, bytes_read);
+        in.pos += bytes_read;
+        return bytes_read;
+    }
+
+    fn reader(in: *SpoolReader) Reader {
+        return .{ .context = in };
+    }
+};
+
+/// State shared by the jobs compressing and writing resources during commit.
+/// Each job only touches its own resource and placement, so jobs can run concurrently.
+const CommitContext = struct {
+    writer: *StitchWriter,
+    outfile: std.fs.File,
+    /// Thread-safe allocator backed by the session arena
+    allocator: std.mem.Allocator,
+    placements: []Placement,
+    /// Stored bytes of compressed resources and of readers that aren't regular files
+    spool: Spool,
+    pool: ?*std.Thread.Pool = null,
+    mutex: std.Thread.Mutex = .{},
+    /// The first error returned by a job
+    err: ?anyerror = null,
+
+    const Phase = enum { compress, hash, fill };
+
+    // Whether the phase has any work to do for the resource
+    fn wants(context: *CommitContext, phase: Phase, resource_index: usize) bool {
+        return switch (phase) {
+            .compress => context.writer.exe.resources.items[resource_index].codec != .none,
+            .hash => context.placements[resource_index].needs_digest or context.writer.checksums,
+            .fill => context.placements[resource_index].duplicate_of == null and !context.placements[resource_index].reused,
+        };
+    }
+
+    // Run the phase's job for every resource that needs it, on the worker pool if there is one
+    fn run(context: *CommitContext, phase: Phase) !void {
+        const resources = context.writer.exe.resources.items;
+        if (context.pool) |pool| {
+            var wait_group = std.Thread.WaitGroup{};
+            for (0..resources.len) |i| {
+                if (!context.wants(phase, i)) continue;
+                wait_group.start();
+                pool.spawn(runPooled, .{ context, phase, i, &wait_group }) catch |err| {
+                    wait_group.finish();
+                    context.fail(err);
+                    break;
+                };
+            }
+            wait_group.wait();
+        } else {
+            for (0..resources.len) |i| {
+                if (!context.wants(phase, i)) continue;
+                context.runJob(phase, i);
+                if (context.err != null) break;
+            }
+        }
+        if (context.err) |err| return err;
+    }
+
+    fn runPooled(context: *CommitContext, phase: Phase, resource_index: usize, wait_group: *std.Thread.WaitGroup) void {
+        defer wait_group.finish();
+        context.runJob(phase, resource_index);
+    }
+
+    fn runJob(context: *CommitContext, phase: Phase, resource_index: usize) void {
+        const result = switch (phase) {
+            .compress => context.compress(resource_index),
+            .hash => context.hash(resource_index),
+            .fill => context.fill(resource_index),
+        };
+        result catch |err| context.fail(err);
+    }
+
+    fn fail(context: *CommitContext, err: anyerror) void {
+        context.mutex.lock();
+        defer context.mutex.unlock();
+        if (context.err == null) context.err = err;
+    }
+
+    // Compress a resource into the spool, so its stored length is known before the layout is computed
+    fn compress(context: *CommitContext, resource_index: usize) !void {
+        const span = beginSpan("compress resource", resource_index);
+        defer span.end();
+        const item = &context.writer.exe.resources.items[resource_index];
+        const placement = &context.placements[resource_index];
+        const session = context.writer.session;
+        var out = SpoolWriter{ .spool = &context.spool, .session = session, .allocator = context.allocator };
+        var hasher = Blake3.init(.{});
+        var chunk_ends = std.ArrayList(u64).init(context.allocator);
+
+        if (placement.data) |data| {
+            var source = std.io.fixedBufferStream(data);
+            placement.uncompressed_length = try StitchWriter.compressStream(item.codec, source.reader(), out.writer(), &hasher, &chunk_ends);
+        } else if (placement.segments) |segments| {
+            var source = SpoolReader{ .spool = &context.spool, .segments = segments, .session = session };
+            placement.uncompressed_length = try StitchWriter.compressStream(item.codec, source.reader(), out.writer(), &hasher, &chunk_ends);
+        } else switch (item.data) {
+            .path => |path| {
+                const file = try std.fs.cwd().openFile(path, .{ .mode = .read_only });
+                defer file.close();
+                placement.uncompressed_length = try StitchWriter.compressStream(item.codec, file.reader(), out.writer(), &hasher, &chunk_ends);
+            },
+            .reader => |reader| {
+                // Positional reads, so jobs compressing resources that share a file don't race on its cursor
+                var source = RawResourceReader{ .underlying_file = reader.context, .offset = placement.source_offset, .length = placement.length, .session = session };
+                placement.uncompressed_length = try StitchWriter.compressStream(item.codec, source.reader(), out.writer(), &hasher, &chunk_ends);
+            },
+            .bytes => unreachable,
+        }
+        try out.flush();
+
+        hasher.final(&placement.content_digest);
+        placement.data = null;
+        placement.segments = out.segments.items;
+        placement.length = out.len;
+
+        if (item.codec == .deflate_chunked) {
+            // The chunk table is stored before the chunks, so its segment goes first
+            var table = SpoolWriter{ .spool = &context.spool, .session = session, .allocator = context.allocator };
+            try StitchWriter.writeChunkTable(table.writer(), chunk_ends.items);
+            try table.flush();
+            try table.segments.appendSlice(context.allocator, out.segments.items);
+            placement.segments = table.segments.items;
+            placement.length = table.len + out.len;
+        }
+    }
+
+    // Hash the stored bytes of a resource, so identical resources can share their data, and compute its checksum
+    fn hash(context: *CommitContext, resource_index: usize) !void {
+        const item = &context.writer.exe.resources.items[resource_index];
+        const placement = &context.placements[resource_index];
+        var hasher = StoredBytesHasher{
+            .digest = if (placement.needs_digest) Blake3.init(.{}) else null,
+            .checksum = if (context.writer.checksums) 0 else null,
+        };
+
+        if (placement.data) |data| {
+            hasher.update(data);
+        } else if (placement.segments) |segments| {
+            for (segments) |segment| try hashFileRange(context.writer.session, &hasher, context.spool.file.?, segment.offset, segment.len);
+        } else switch (item.data) {
+            .path => |path| {
+                const file = try std.fs.cwd().openFile(path, .{ .mode = .read_only });
+                defer file.close();
+                try hashFileRange(context.writer.session, &hasher, file, 0, placement.length);
+            },
+            .reader => |reader| try hashFileRange(context.writer.session, &hasher, reader.context, placement.source_offset, placement.length),
+            .bytes => unreachable,
+        }
+        if (hasher.checksum) |checksum| placement.checksum = checksum;
+        if (hasher.digest) |*digest| {
+            digest.final(&placement.digest);
+            if (item.codec == .none) placement.content_digest = placement.digest;
+        }
+
+        if (placement.previous_offset) |offset| {
+            // A previous resource that can't be read is simply not reused
+            var previous_hasher = Blake3.init(.{});
+            hashFileRange(context.writer.session, &previous_hasher, context.writer.session.org_exe_file, offset + 8, placement.length) catch {
+                placement.previous_offset = null;
+                return;
+            };
+            previous_hasher.final(&placement.previous_digest);
+        }
+    }
+
+    fn hashFileRange(session: *Self, hasher: anytype, file: std.fs.File, offset: u64, len: u64) !void {
+        var buffer: [64 * 1024]u8 = undefined;
+        var pos = offset;
+        const end = offset + len;
+        while (pos < end) {
+            const bytes_read = try file.pread(buffer[0..@intCast(@min(buffer.len, end - pos))], pos);
+            session.addStat(.syscalls, 1);
+            session.addStat(.bytes_read, bytes_read);
+            if (bytes_read == 0) return error.EndOfStream;
+            hasher.update(buffer[0..bytes_read]);
+            pos += bytes_read;
+        }
+    }
+
+    // Write the resource magic and data at the resource's precomputed offset
+    fn fill(context: *CommitContext, resource_index: usize) !void {
+        const span = beginSpan("write resource", resource_index);
+        defer span.end();
+        const item = &context.writer.exe.resources.items[resource_index];
+        const placement = &context.placements[resource_index];
+        var magic: [8]u8 = undefined;
+        std.mem.writeInt(u64, &magic, ResourceMagic, .big);
+
+        if (placement.data) |data| {
+            var iovecs = [_]std.os.iovec_const{
+                .{ .iov_base = &magic, .iov_len = magic.len },
+                .{ .iov_base = data.ptr, .iov_len = data.len },
+            };
+            context.writer.session.addStat(.syscalls, 1);
+            context.writer.session.addStat(.bytes_written, magic.len + data.len);
+            return context.outfile.pwritevAll(&iovecs, placement.offset);
+        }
+
+        // File and spool contents are copied by the kernel
+        context.writer.session.addStat(.syscalls, 1);
+        context.writer.session.addStat(.bytes_written, magic.len);
+        try context.outfile.pwriteAll(&magic, placement.offset);
+        if (placement.segments) |segments| {
+            var offset = placement.offset + 8;
+            for (segments) |segment| {
+                try context.writer.session.copyFileRange(context.spool.file.?, segment.offset, context.outfile, offset, segment.len);
+                offset += segment.len;
+            }
+            return;
+        }
+        switch (item.data) {
+            .path => |path| {
+                const file = try std.fs.cwd().openFile(path, .{ .mode = .read_only });
+                defer file.close();
+                try context.writer.session.copyFileRange(file, 0, context.outfile, placement.offset + 8, placement.length);
+            },
+            .reader => |reader| try context.writer.session.copyFileRange(reader.context, placement.source_offset, context.outfile, placement.offset + 8, placement.length),
+            .bytes => unreachable,
+        }
+    }
+};
+
+/// Use `initWriter` to create this writer, which allows you to append resources to an executable in
+/// a format recognized by `StitchReader`
+pub const StitchWriter = struct {
+    session: *Self = undefined,
+    exe: StitchExecutable = undefined,
+
+    /// Absolute path of the input executable
+    input_path: []const u8 = "",
+
+    /// Directory of the temporary file used during commit, which is next to the output
+    spool_dir: []const u8 = ".",
+
+    /// Number of commit threads, where null means one per CPU. See `setThreadCount`
+    thread_count: ?u32 = null,
+
+    /// Alignment of resource data in the output. See `setAlignment`
+    alignment: u64 = 1,
+
+    /// Whether content digests are written to the index. See `setContentDigests`
+    content_digests: bool = false,
+
+    /// Whether checksums are written to the index. See `setChecksums`
+    checksums: bool = false,
+
+    fn init(session: *Self, input_path: []const u8) StitchWriter {
+        return .{
+            .session = session,
+            .input_path = input_path,
+            .exe = .{
+                .resources = std.ArrayList(Resource).init(session.arena.allocator()),
+                .index = .{ .entries = std.ArrayList(IndexEntry).init(session.arena.allocator()) },
+                .tail = .{ .index_offset = 0, .version = StitchVersion, .eof_magic = EofMagic },
+            },
+        };
+    }
+
+    /// Closes the stitch session and frees all resources.
+    /// This must be called to ensure the writer session is properly closed.
+    pub fn deinit(writer: *StitchWriter) void {
+        writer.session.deinit();
+    }
+
+    /// Write original executable, index, resources, and tail to output file.
+    pub fn commit(writer: *StitchWriter) StitchError!void {
+        // Wrapper to reclassify errors into StitchError.IoError
+        return commitImpl(writer) catch |err| {
+            if (!Diagnostic.isDiagnostic(err)) {
+                writer.session.setDiagnostics(.{ .IoError = "Unable to commit resources to output file" });
+                return StitchError.IoError;
+            }
+            return @as(StitchError, @errorCast(err));
+        };
+    }
+
+    fn commitImpl(writer: *StitchWriter) !void {
+        writer.session.resetDiagnostics();
+        const commit_start = std.time.nanoTimestamp();
+        defer writer.session.addStatTime(.commit_ns, commit_start);
+        const commit_span = beginSpan("commit", null);
+        defer commit_span.end();
+        const outfile = writer.session.output_exe_file orelse writer.session.org_exe_file;
+
+        // A payload already stitched to the input is replaced rather than nested, so the original executable
+        // ends where that payload starts
+        var exe_file_len = try writer.session.org_exe_file.getEndPos();
+        var previous: ?StitchReader = initReaderWithOptions(writer.session.arena.child_allocator, writer.input_path, .{ .mode = .file }) catch null;
+        defer if (previous) |*p| p.deinit();
+        if (previous) |*p| {
+            if (p.getPayloadOffset()) |offset| {
+                exe_file_len = offset;
+            } else |_| {
+                p.deinit();
+                previous = null;
+            }
+        }
+
+        // Copy the original executable if we're not stitching to the original, otherwise stitch in place
+        if (writer.session.output_exe_file != null) {
+            const copy_start = std.time.nanoTimestamp();
+            defer writer.session.addStatTime(.commit_copy_ns, copy_start);
+            const span = beginSpan("copy executable", null);
+            defer span.end();
+            try writer.session.copyFileRange(writer.session.org_exe_file, 0, outfile, 0, exe_file_len);
+        }
+
+        // Commit jobs allocate concurrently, so the session arena is guarded
+        var thread_safe_allocator = std.heap.ThreadSafeAllocator{ .child_allocator = writer.session.arena.allocator() };
+        var context = CommitContext{
+            .writer = writer,
+            .outfile = outfile,
+            .allocator = thread_safe_allocator.allocator(),
+            .placements = try writer.session.arena.allocator().alloc(Placement, writer.exe.resources.items.len),
+            .spool = .{ .dir = writer.spool_dir },
+        };
+        defer context.spool.deinit();
+
+        // Resources are filled in by a worker pool, unless a single thread is requested
+        var pool: std.Thread.Pool = undefined;
+        if (writer.thread_count != 1 and context.placements.len > 1) {
+            try pool.init(.{ .allocator = context.allocator, .n_jobs = writer.thread_count });
+            context.pool = &pool;
+        }
+        defer if (context.pool) |p| p.deinit();
+
+        // Determine the stored length and offset of every resource, compressing resources as needed.
+        // Resources of the previous payload can only be reused when stitching to the original.
+        const reusable: ?*StitchReader = if (writer.session.output_exe_file != null) null else if (previous) |*p| p else null;
+        const offset = try writer.layoutResources(&context, exe_file_len, reusable);
+
+        // Resource data is written before the index and tail, so a failed or interrupted commit never leaves
+        // a tail that points at resources which haven't been written. When stitching to the original, the previous
+        // tail is invalidated first, since new resources overwrite the payload it points at.
+        if (writer.session.output_exe_file == null and previous != null) try writer.session.invalidateTail(outfile);
+        const fill_start = std.time.nanoTimestamp();
+        const fill_span = beginSpan("write resources", null);
+        try context.run(.fill);
+        fill_span.end();
+        writer.session.addStatTime(.commit_fill_ns, fill_start);
+        const index_start = std.time.nanoTimestamp();
+        const index_span = beginSpan("write index", null);
+        defer index_span.end();
+        defer writer.session.addStatTime(.commit_index_ns, index_start);
+        _ = try writer.writeMetadata(outfile, context.placements, exe_file_len, offset, context.allocator);
+    }
+
+    /// Write the original executable, resources, index and tail to `stream`, which can be any writer, such as stdout,
+    /// a pipe or a socket, since the output is written front to back and never seeked or read back. Stored lengths are
+    /// taken from file sizes up front and offsets from the running byte count, so the executable is written right away,
+    /// while resources are compressed. As with `commit`, compressed resources and readers that aren't regular files are
+    /// staged in a temporary file first, which is created in `TMPDIR` for sessions from `initWriterToStream`.
+    /// The output is identical to what `commit` writes to a new file.
+    pub fn commitToStream(writer: *StitchWriter, stream: anytype) StitchError!void {
+        // Wrapper to reclassify errors into StitchError.IoError
+        return writer.commitToStreamImpl(stream) catch |err| {
+            if (!Diagnostic.isDiagnostic(err)) {
+                writer.session.setDiagnostics(.{ .IoError = "Unable to write resources to output stream" });
+                return StitchError.IoError;
+            }
+            return @as(StitchError, @errorCast(err));
+        };
+    }
+
+    fn commitToStreamImpl(writer: *StitchWriter, stream: anytype) !void {
+        writer.session.resetDiagnostics();
+        const commit_start = std.time.nanoTimestamp();
+        defer writer.session.addStatTime(.commit_ns, commit_start);
+        const commit_span = beginSpan("commit", null);
+        defer commit_span.end();
+        var sink = StreamSink(@TypeOf(stream)){ .buffered = .{ .unbuffered_writer = stream }, .session = writer.session };
+
+        // The executable doesn't depend on the resources, so it's written before they're read
+        const exe_file_len = try writer.session.executableLength(writer.input_path);
+        {
+            const copy_start = std.time.nanoTimestamp();
+            defer writer.session.addStatTime(.commit_copy_ns, copy_start);
+            const span = beginSpan("copy executable", null);
+            defer span.end();
+            try sink.writeFileRange(writer.session.org_exe_file, 0, exe_file_len);
+            try sink.flush();
+        }
+
+        // Commit jobs allocate concurrently, so the session arena is guarded. Jobs only compress and hash here.
+        var thread_safe_allocator = std.heap.ThreadSafeAllocator{ .child_allocator = writer.session.arena.allocator() };
+        var context = CommitContext{
+            .writer = writer,
+            .outfile = undefined,
+            .allocator = thread_safe_allocator.allocator(),
+            .placements = try writer.session.arena.allocator().alloc(Placement, writer.exe.resources.items.len),
+            .spool = .{ .dir = writer.spool_dir },
+        };
+        defer context.spool.deinit();
+        var pool: std.Thread.Pool = undefined;
+        if (writer.thread_count != 1 and context.placements.len > 1) {
+            try pool.init(.{ .allocator = context.allocator, .n_jobs = writer.thread_count });
+            context.pool = &pool;
+        }
+        defer if (context.pool) |p| p.deinit();
+
+        const end_of_resources = try writer.layoutResources(&context, exe_file_len, null);
+
+        // Resources are laid out in index order, so they're written in that order, after any alignment padding.
+        // Duplicates share the data of the copy that's written.
+        const fill_start = std.time.nanoTimestamp();
+        const fill_span = beginSpan("write resources", null);
+        var magic: [8]u8 = undefined;
+        std.mem.writeInt(u64, &magic, ResourceMagic, .big);
+        for (writer.exe.resources.items, context.placements) |*item, *placement| {
+            if (placement.duplicate_of != null) continue;
+            try sink.writer().writeByteNTimes(0, placement.offset - sink.pos);
+            try sink.writer().writeAll(&magic);
+            if (placement.data) |data| {
+                try sink.writer().writeAll(data);
+            } else if (placement.segments) |segments| {
+                for (segments) |segment| try sink.writeFileRange(context.spool.file.?, segment.offset, segment.len);
+            } else switch (item.data) {
+                .path => |path| {
+                    const file = try std.fs.cwd().openFile(path, .{ .mode = .read_only });
+                    defer file.close();
+                    try sink.writeFileRange(file, 0, placement.length);
+                },
+                .reader => |reader| try sink.writeFileRange(reader.context, placement.source_offset, placement.length),
+                .bytes => unreachable,
+            }
+        }
+        fill_span.end();
+        writer.session.addStatTime(.commit_fill_ns, fill_start);
+
+        const index_start = std.time.nanoTimestamp();
+        const index_span = beginSpan("write index", null);
+        defer index_span.end();
+        defer writer.session.addStatTime(.commit_index_ns, index_start);
+        try writer.serializeMetadata(sink.writer(), context.placements, exe_file_len, end_of_resources);
+        try sink.flush();
+    }
+
+    // Front-to-back output of `commitToStream`. Small writes are buffered, and file ranges are sent by the kernel
+    // when the stream is a file writer, such as stdout. `pos` counts the bytes written, which is the offset in the output.
+    fn StreamSink(comptime Stream: type) type {
+        return struct {
+            buffered: std.io.BufferedWriter(64 * 1024, Stream),
+            session: *Self,
+            pos: u64 = 0,
+
+            const Sink = @This();
+            const Writer = std.io.Writer(*Sink, Stream.Error, write);
+
+            fn write(sink: *Sink, bytes: []const u8) Stream.Error!usize {
+                const len = try sink.buffered.write(bytes);
+                sink.session.addStat(.bytes_written, len);
+                sink.pos += len;
+                return len;
+            }
+
+            fn writer(sink: *Sink) Writer {
+                return .{ .context = sink };
+            }
+
+            fn flush(sink: *Sink) Stream.Error!void {
+                sink.session.addStat(.syscalls, 1);
+                try sink.buffered.flush();
+            }
+
+            // Write `len` bytes of `file`, starting at `offset`
+            fn writeFileRange(sink: *Sink, file: std.fs.File, offset: u64, len: u64) !void {
+                if (Stream == std.fs.File.Writer) {
+                    try sink.flush();
+                    sink.session.addStat(.syscalls, 1);
+                    sink.session.addStat(.bytes_read, len);
+                    sink.session.addStat(.bytes_written, len);
+                    try sink.buffered.unbuffered_writer.context.writeFileAll(file, .{ .in_offset = offset, .in_len = len });
+                    sink.pos += len;
+                    return;
+                }
+                var buffer: [64 * 1024]u8 = undefined;
+                var pos = offset;
+                while (pos < offset + len) {
+                    const bytes_read = try file.pread(buffer[0..@intCast(@min(buffer.len, offset + len - pos))], pos);
+                    sink.session.addStat(.syscalls, 1);
+                    sink.session.addStat(.bytes_read, bytes_read);
+                    if (bytes_read == 0) return error.EndOfStream;
+                    try sink.writer().writeAll(buffer[0..bytes_read]);
+                    pos += bytes_read;
+                }
+            }
+        };
+    }
+
+    // Find the stored length of every resource, compressing resources as needed, and lay out the resources after the
+    // original executable, which is `exe_file_len` bytes. Returns the offset where the resources end.
+    // Resources of `previous`, a reader of the payload being replaced in place, are reused if they're unchanged.
+    fn layoutResources(writer: *StitchWriter, context: *CommitContext, exe_file_len: u64, previous: ?*StitchReader) !u64 {
+        try writer.planResources(context.placements, context.allocator, &context.spool);
+        const compress_start = std.time.nanoTimestamp();
+        const compress_span = beginSpan("compress resources", null);
+        try context.run(.compress);
+        compress_span.end();
+        writer.session.addStatTime(.commit_compress_ns, compress_start);
+
+        // Resources with identical stored bytes are stored once. When stitching to the original,
+        // resources that are unchanged since the previous commit are left where they are.
+        try markDuplicateCandidates(context.placements, context.allocator);
+        if (writer.content_digests) {
+            for (writer.exe.resources.items, context.placements) |*item, *placement| {
+                if (item.codec == .none) placement.needs_digest = true;
+            }
+        }
+        if (previous) |p| writer.matchPrevious(p, context.placements);
+        const hash_start = std.time.nanoTimestamp();
+        const hash_span = beginSpan("hash resources", null);
+        try context.run(.hash);
+        hash_span.end();
+        writer.session.addStatTime(.commit_hash_ns, hash_start);
+        var offset = exe_file_len;
+        for (context.placements) |*placement| {
+            if (placement.previous_offset == null) continue;
+            if (!std.mem.eql(u8, &placement.digest, &placement.previous_digest)) continue;
+            if (!std.mem.isAligned(placement.previous_offset.? + 8, writer.alignment)) continue;
+            placement.offset = placement.previous_offset.?;
+            placement.reused = true;
+            offset = @max(offset, placement.offset + 8 + placement.length);
+        }
+        try findDuplicates(context.placements, context.allocator);
+
+        // Lay out the other resources back to back after the original executable and any reused resources.
+        // Duplicates point at the copy that's kept.
+        for (context.placements) |*placement| {
+            if (placement.reused) continue;
+            if (placement.duplicate_of) |original| {
+                placement.offset = context.placements[original].offset;
+                continue;
+            }
+            placement.offset = std.mem.alignForward(u64, offset + 8, writer.alignment) - 8;
+            offset = placement.offset + 8 + placement.length;
+        }
+        return offset;
+    }
+
+    // Find resources in the previous payload with the same name, compression and stored length as a resource
+    // being committed. Both are hashed to find out if the previous copy can be reused.
+    fn matchPrevious(writer: *StitchWriter, previous: *StitchReader, placements: []Placement) void {
+        for (writer.exe.index.entries.items, placements) |*entry, *placement| {
+            const index = previous.getResourceIndex(entry.name) catch continue;
+            const old = previous.getStoredEntry(index) catch continue;
+            if (entryCodec(old.resource_type) != entryCodec(entry.resource_type)) continue;
+            if (old.byte_length != placement.length) continue;
+            placement.previous_offset = old.resource_offset;
+            placement.needs_digest = true;
+        }
+    }
+
+    // Find the stored length of each resource without reading file contents. Readers that aren't
+    // backed by a regular file, such as pipes, are copied to the spool since their length isn't known.
+    fn planResources(writer: *StitchWriter, placements: []Placement, allocator: std.mem.Allocator, spool: *Spool) !void {
+        for (writer.exe.resources.items, placements) |*item, *placement| {
+            placement.* = .{};
+            switch (item.data) {
+                .bytes => |bytes| {
+                    placement.data = bytes;
+                    placement.length = bytes.len;
+                },
+                .path => |path| {
+                    const stat = std.fs.cwd().statFile(path) catch |err| switch (err) {
+                        error.FileNotFound => {
+                            writer.session.setDiagnostics(.{ .CouldNotOpenInputFile = path });
+                            return StitchError.CouldNotOpenInputFile;
+                        },
+                        else => return err,
+                    };
+                    placement.length = stat.size;
+                },
+                .reader => |reader| {
+                    const stat = reader.context.stat() catch null;
+                    if (stat != null and stat.?.kind == .file) {
+                        placement.source_offset = try reader.context.getPos();
+                        placement.length = stat.?.size -| placement.source_offset;
+                    } else {
+                        var out = SpoolWriter{ .spool = spool, .session = writer.session, .allocator = allocator };
+                        try out.pump(reader);
+                        try out.flush();
+                        placement.segments = out.segments.items;
+                        placement.length = out.len;
+                    }
+                },
+            }
+            placement.uncompressed_length = placement.length;
+        }
+    }
+
+    // Only resources whose stored length matches another resource can be duplicates,
+    // so resources with a unique length are never read for hashing
+    fn markDuplicateCandidates(placements: []Placement, allocator: std.mem.Allocator) !void {
+        var counts = std.AutoHashMap(u64, u32).init(allocator);
+        defer counts.deinit();
+        for (placements) |*placement| {
+            const count = try counts.getOrPutValue(placement.length, 0);
+            count.value_ptr.* += 1;
+        }
+        for (placements) |*placement| {
+            placement.needs_digest = counts.get(placement.length).? > 1;
+        }
+    }
+
+    // Point each hashed resource at the copy that's kept of resources with the same digest: a reused
+    // resource if there is one, otherwise the first resource with that digest
+    fn findDuplicates(placements: []Placement, allocator: std.mem.Allocator) !void {
+        var kept = std.AutoHashMap([Blake3.digest_length]u8, usize).init(allocator);
+        defer kept.deinit();
+        for (placements, 0..) |*placement, i| {
+            if (placement.reused) try kept.put(placement.digest, i);
+        }
+        for (placements, 0..) |*placement, i| {
+            if (!placement.needs_digest or placement.reused) continue;
+            const first = try kept.getOrPut(placement.digest);
+            if (first.found_existing) {
+                placement.duplicate_of = first.value_ptr.*;
+            } else {
+                first.value_ptr.* = i;
+            }
+        }
+    }
+
+    // Write the index padding, index and extensions starting at `end_of_resources`, truncate anything left of a longer,
+    // previous payload, and write the tail last, so the output only has a valid tail once everything else is written.
+    // Returns the offset where the written metadata ends, which is the length of the output.
+    fn writeMetadata(writer: *StitchWriter, outfile: std.fs.File, placements: []const Placement, exe_file_len: u64, end_of_resources: u64, allocator: std.mem.Allocator) !u64 {
+        var buffer = std.ArrayList(u8).init(allocator);
+        defer buffer.deinit();
+        try writer.serializeMetadata(buffer.writer(), placements, exe_file_len, end_of_resources);
+        const end = end_of_resources + buffer.items.len;
+        const tail_offset = buffer.items.len - 17;
+        writer.session.addStat(.syscalls, 3);
+        writer.session.addStat(.bytes_written, buffer.items.len);
+        try outfile.pwriteAll(buffer.items[0..tail_offset], end_of_resources);
+        try outfile.setEndPos(end);
+        try outfile.pwriteAll(buffer.items[tail_offset..], end_of_resources + tail_offset);
+        return end;
+    }
+
+    // Write the index padding, index, extensions and tail to `stream`, for resources placed after an executable
+    // of `exe_file_len` bytes and ending at `end_of_resources`
+    fn serializeMetadata(writer: *StitchWriter, stream: anytype, placements: []const Placement, exe_file_len: u64, end_of_resources: u64) !void {
+        const any_compressed = for (writer.exe.resources.items) |*item| {
+            if (item.codec != .none) break true;
+        } else false;
+        const version = payloadVersion(writer.exe.tail.version, any_compressed);
+        const endian = indexEndian(version);
+
+        // No resources = write empty tail
+        var index_offset: u64 = 0;
+        if (placements.len > 0) {
+            // Version 2 records are used in place by readers, so the index is padded to natural alignment
+            index_offset = end_of_resources;
+            if (version >= 2) {
+                const padding = std.mem.alignForward(u64, index_offset, @alignOf(IndexRecord)) - index_offset;
+                try stream.writeByteNTimes(0, padding);
+                index_offset += padding;
+            }
+
+            switch (version) {
+                1 => try writer.writeIndexV1(stream, placements),
+                else => try writer.writeIndexV2(stream, placements),
+            }
+
+            // Uncompressed lengths are only needed if something is compressed. Readers that don't know the extension skip it.
+            if (any_compressed) {
+                try writeExtensionHeader(stream, endian, IndexExtension.uncompressed_lengths, placements.len * 8);
+                for (placements) |*placement| try stream.writeInt(u64, placement.uncompressed_length, endian);
+            }
+            if (writer.alignment > 1) {
+                try writeExtensionHeader(stream, endian, IndexExtension.resource_alignment, 8);
+                try stream.writeInt(u64, writer.alignment, endian);
+                try writeExtensionHeader(stream, endian, IndexExtension.executable_length, 8);
+                try stream.writeInt(u64, exe_file_len, endian);
+            }
+            if (writer.content_digests) {
+                try writeExtensionHeader(stream, endian, IndexExtension.content_digests, placements.len * Blake3.digest_length);
+                for (placements) |*placement| try stream.writeAll(&placement.content_digest);
+            }
+            if (writer.checksums) {
+                try writeExtensionHeader(stream, endian, IndexExtension.checksums, placements.len * 4);
+                for (placements) |*placement| try stream.writeInt(u32, placement.checksum, endian);
+            }
+        }
+
+        // Write the tail
+        try stream.writeInt(u64, index_offset, .big);
+        try stream.writeByte(version);
+        try stream.writeInt(u64, eofMagic(version), .big);
+    }
+
+    // Write a version 1 index: big-endian fields, with each name stored inline in its entry
+    fn writeIndexV1(writer: *StitchWriter, stream: anytype, placements: []const Placement) !void {
+        try stream.writeInt(u64, writer.exe.index.entries.items.len, .big);
+        for (writer.exe.index.entries.items, placements) |*entry, *placement| {
+            try stream.writeInt(u64, entry.name.len, .big);
+            try stream.writeAll(entry.name);
+            try stream.writeByte(entry.resource_type);
+            try stream.writeInt(u64, placement.offset, .big);
+            try stream.writeInt(u64, placement.length, .big);
+            try stream.writeAll(&entry.scratch_bytes);
+        }
+    }
+
+    // Write a version 2 index: a header, fixed-size little-endian records, and a string table with all names
+    fn writeIndexV2(writer: *StitchWriter, stream: anytype, placements: []const Placement) !void {
+        const entries = writer.exe.index.entries.items;
+        var strings_len: u64 = 0;
+        for (entries) |*entry| strings_len += entry.name.len;
+
+        try stream.writeInt(u64, entries.len, .little);
+        try stream.writeInt(u64, strings_len, .little);
+
+        var name_offset: u64 = 0;
+        for (entries, placements) |*entry, *placement| {
+            try stream.writeInt(u64, placement.offset, .little);
+            try stream.writeInt(u64, placement.length, .little);
+            try stream.writeInt(u64, name_offset, .little);
+            try stream.writeInt(u32, std.math.cast(u32, entry.name.len) orelse return error.NameTooLong, .little);
+            try stream.writeByte(entry.resource_type);
+            try stream.writeByteNTimes(0, 3);
+            try stream.writeAll(&entry.scratch_bytes);
+            name_offset += entry.name.len;
+        }
+
+        for (entries) |*entry| try stream.writeAll(entry.name);
+    }
+
+    // Write the header of an index extension. The payload follows, in the byte order of the index.
+    fn writeExtensionHeader(stream: anytype, endian: std.builtin.Endian, tag: u64, len: u64) !void {
+        try stream.writeInt(u64, tag, endian);
+        try stream.writeInt(u64, len, endian);
+    }
+
+    // Compress `reader` into `stream` and return the uncompressed length. The uncompressed bytes are also hashed.
+    // For `deflate_chunked`, only the chunks are written and their ends are appended to `chunk_ends`;
+    // the caller stores the chunk table from `writeChunkTable` before them.
+    fn compressStream(codec: Codec, reader: anytype, stream: anytype, hasher: *Blake3, chunk_ends: *std.ArrayList(u64)) !u64 {
+        var compressor = switch (codec) {
+            .none => unreachable,
+            .deflate => try std.compress.flate.compressor(stream, .{}),
+            .deflate_chunked => return compressChunks(reader, stream, hasher, chunk_ends),
+        };
+        var buffer: [64 * 1024]u8 = undefined;
+        var len: u64 = 0;
+        while (true) {
+            const bytes_read = try reader.read(&buffer);
+            if (bytes_read == 0) break;
+            hasher.update(buffer[0..bytes_read]);
+            try compressor.writer().writeAll(buffer[0..bytes_read]);
+            len += bytes_read;
+        }
+        try compressor.finish();
+        return len;
+    }
+
+    // Compress `reader` in independently compressed chunks, written to `stream` as they're compressed.
+    // The end of each compressed chunk, relative to the first, is appended to `ends`.
+    fn compressChunks(reader: anytype, stream: anytype, hasher: *Blake3, ends: *std.ArrayList(u64)) !u64 {
+        const chunk = try ends.allocator.alloc(u8, ChunkSize);
+        defer ends.allocator.free(chunk);
+        var counter = std.io.countingWriter(stream);
+
+        var len: u64 = 0;
+        while (true) {
+            const bytes_read = try reader.readAll(chunk);
+            if (bytes_read == 0) break;
+            hasher.update(chunk[0..bytes_read]);
+            var source = std.io.fixedBufferStream(chunk[0..bytes_read]);
+            try std.compress.flate.compress(source.reader(), counter.writer(), .{});
+            try ends.append(counter.bytes_written);
+            len += bytes_read;
+            if (bytes_read < chunk.len) break;
+        }
+        return len;
+    }
+
+    // Write the table stored before the chunks of a `deflate_chunked` resource: the chunk size, the number of chunks,
+    // and the end of each compressed chunk relative to the end of the table
+    fn writeChunkTable(stream: anytype, ends: []const u64) !void {
+        try stream.writeInt(u64, ChunkSize, .little);
+        try stream.writeInt(u64, ends.len, .little);
+        for (ends) |end| try stream.writeInt(u64, end, .little);
+    }
+
+    /// Set the number of threads used to compress and write resources on commit.
+    /// The default of null uses one thread per CPU, and 1 writes everything on the calling thread.
+    /// The output is identical regardless of the number of threads.
+    pub fn setThreadCount(writer: *StitchWriter, thread_count: ?u32) void {
+        writer.thread_count = thread_count;
+    }
+
+    /// Record a CRC-32C checksum of every resource's stored bytes in the index, which readers use to detect
+    /// corrupt resources. See `StitchReader.verifyAll` and `ReaderOptions.verify`.
+    /// Resources are read once more during commit to compute the checksums.
+    /// Checksums use the CPU's CRC instructions where available: on x86-64 they're detected at runtime, while on
+    /// AArch64 they're only used if the build targets the CRC extension. Elsewhere, checksumming falls back to
+    /// a table-driven implementation that is several times slower.
+    pub fn setChecksums(writer: *StitchWriter, enabled: bool) void {
+        writer.checksums = enabled;
+    }
+
+    /// Record a BLAKE3 digest of every resource's uncompressed content in the index. This lets
+    /// `StitchReader.extractResource` name extracted files by their content, so they're shared across executables.
+    /// Uncompressed resources are read once more during commit to compute the digest.
+    pub fn setContentDigests(writer: *StitchWriter, enabled: bool) void {
+        writer.content_digests = enabled;
+    }
+
+    /// Pad the output so the data of every resource starts at an offset that's a multiple of `alignment`,
+    /// such as 64 for cache lines, 4096 for pages, or 2 MiB for huge pages. This must be a power of two.
+    /// The default of 1 adds no padding. In `mapped` reader sessions, resource slices then have the same
+    /// alignment in memory, up to the page size.
+    pub fn setAlignment(writer: *StitchWriter, alignment: u64) StitchError!void {
+        writer.session.resetDiagnostics();
+        if (!std.math.isPowerOfTwo(alignment)) {
+            writer.session.setDiagnostics(.{ .InvalidArgument = "Resource alignment must be a power of two" });
+            return StitchError.InvalidArgument;
+        }
+        writer.alignment = alignment;
+    }
+
+    /// Set the format version to write. The default is `StitchVersion` (1), which all readers understand.
+    /// Version 2 stores the index as fixed-size records and a string table, which readers can use in place.
+    /// If any resource is compressed, `CompressedStitchVersion` (3) is written instead of a lower version.
+    pub fn setFormatVersion(writer: *StitchWriter, version: u8) StitchError!void {
+        writer.session.resetDiagnostics();
+        if (version < 1 or version > LatestStitchVersion) {
+            writer.session.setDiagnostics(.{ .InvalidArgument = "Unsupported format version" });
+            return StitchError.InvalidArgument;
+        }
+        writer.exe.tail.version = version;
+    }
+
+    /// Compress a resource when it's written, using the index returned by the addResource... functions.
+    /// Readers decompress transparently, and report the uncompressed size through `getResourceSize`.
+    /// Compressing any resource writes format version `CompressedStitchVersion`, which readers that predate
+    /// compressed resources reject instead of returning compressed bytes.
+    pub fn setCompression(writer: *StitchWriter, resource_index: u64, codec: Codec) StitchError!void {
+        writer.session.resetDiagnostics();
+        if (resource_index >= writer.exe.index.entries.items.len) {
+            writer.session.setDiagnostics(.{ .ResourceNotFound = .{ .index = resource_index } });
+            return StitchError.ResourceNotFound;
+        }
+        writer.exe.resources.items[resource_index].codec = codec;
+        writer.exe.index.entries.items[resource_index].resource_type = switch (codec) {
+            .none => EntryType.blob,
+            .deflate => EntryType.deflate,
+            .deflate_chunked => EntryType.deflate_chunked,
+        };
+    }
+
+    /// Set the scratch bytes for a resource, using the index returned by the addResource... functions.
+    /// The default scratch bytes is all-zero.
+    pub fn setScratchBytes(writer: *StitchWriter, resource_index: u64, bytes: [8]u8) StitchError!void {
+        writer.session.resetDiagnostics();
+        if (resource_index >= writer.exe.index.entries.items.len) {
+            writer.session.setDiagnostics(.{ .ResourceNotFound = .{ .index = resource_index } });
+            return StitchError.ResourceNotFound;
+        }
+        writer.exe.index.entries.items[resource_index].scratch_bytes = bytes;
+    }
+
+    /// Reads the file at `path` and adds it to the list of resources to be written
+    /// This option has minimal memory overhead
     /// If name is null, the name of the resource will be the basename of the path
     /// Returns the zero-based resource index
     pub fn addResourceFromPath(writer: *StitchWriter, name: ?[]const u8, path: []const u8) !u64 {
@@ -365,143 +2007,1288 @@ pub const StitchWriter = struct {
         return writer.exe.resources.items.len - 1;
     }
 
-    /// Adds the reader to the list of resources
-    /// This option has minimal memory overhead
-    /// The reader must stay valid until the the Stitch session is closed
+    /// Adds the reader to the list of resources
+    /// This option has minimal memory overhead
+    /// The reader must stay valid until the the Stitch session is closed
+    /// Returns the zero-based resource index
+    pub fn addResourceFromReader(writer: *StitchWriter, name: []const u8, reader: std.fs.File.Reader) !u64 {
+        writer.session.resetDiagnostics();
+        try writer.exe.resources.append(Resource{ .magic = ResourceMagic, .data = .{ .reader = reader } });
+        try writer.exe.index.entries.append(IndexEntry{
+            .name = name,
+            .resource_type = 0,
+            .resource_offset = 0,
+            .byte_length = 0,
+            .scratch_bytes = [_]u8{0} ** 8,
+        });
+
+        return writer.exe.resources.items.len - 1;
+    }
+
+    /// Adds the slice to the list of resources
+    /// The provided `data` buffer must stay valid until `commit` is called
+    /// Returns the zero-based resource index
+    pub fn addResourceFromSlice(writer: *StitchWriter, name: []const u8, data: []const u8) !u64 {
+        writer.session.resetDiagnostics();
+        try writer.exe.resources.append(Resource{ .magic = ResourceMagic, .data = .{ .bytes = data } });
+        try writer.exe.index.entries.append(IndexEntry{
+            .name = name,
+            .resource_type = 0,
+            .resource_offset = 0,
+            .byte_length = data.len,
+            .scratch_bytes = [_]u8{0} ** 8,
+        });
+
+        return writer.exe.resources.items.len - 1;
+    }
+};
+
+/// Writes to a file at an advancing offset with positional writes, so the file cursor isn't used.
+/// Written bytes are also fed to `hasher`, if there is one.
+const PositionalWriter = struct {
+    file: std.fs.File,
+    pos: u64,
+    session: *Self,
+    hasher: ?*StoredBytesHasher = null,
+
+    const Writer = std.io.Writer(*PositionalWriter, std.fs.File.PWriteError, write);
+
+    fn write(out: *PositionalWriter, bytes: []const u8) std.fs.File.PWriteError!usize {
+        const len = try out.file.pwrite(bytes, out.pos);
+        out.session.addStat(.syscalls, 1);
+        out.session.addStat(.bytes_written, len);
+        if (out.hasher) |hasher| hasher.update(bytes[0..len]);
+        out.pos += len;
+        return len;
+    }
+
+    fn writer(out: *PositionalWriter) Writer {
+        return .{ .context = out };
+    }
+};
+
+/// Bytes appended in memory up to a limit, and moved to a temporary file past it,
+/// so the memory used by a streaming writer doesn't depend on the number of resources
+const SpillBuffer = struct {
+    memory: std.ArrayListUnmanaged(u8) = .{},
+    file: ?std.fs.File = null,
+    /// Path of the temporary file, which is deleted by `deinit`
+    path: []const u8 = "",
+    len: u64 = 0,
+
+    const Error = std.fs.File.PReadError || error{EndOfStream};
+
+    fn append(spill: *SpillBuffer, session: *Self, dir: []const u8, limit: usize, bytes: []const u8) !void {
+        if (spill.file == null and spill.memory.items.len + bytes.len > limit) {
+            const name = try generateUniqueFileName(session.arena.allocator());
+            spill.path = try std.fs.path.join(session.arena.allocator(), &.{ dir, name });
+            spill.file = try std.fs.cwd().createFile(spill.path, .{ .read = true, .exclusive = true });
+            try spill.writeAt(session, spill.memory.items, 0);
+            spill.memory.clearAndFree(session.arena.child_allocator);
+        }
+        if (spill.file != null) {
+            try spill.writeAt(session, bytes, spill.len);
+        } else {
+            try spill.memory.appendSlice(session.arena.child_allocator, bytes);
+        }
+        spill.len += bytes.len;
+    }
+
+    // Overwrite bytes at `offset`, which must have been appended before unless the buffer is spilled
+    fn writeAt(spill: *SpillBuffer, session: *Self, bytes: []const u8, offset: u64) !void {
+        if (spill.file) |file| {
+            session.addStat(.syscalls, 1);
+            session.addStat(.bytes_written, bytes.len);
+            try file.pwriteAll(bytes, offset);
+        } else {
+            @memcpy(spill.memory.items[@intCast(offset)..][0..bytes.len], bytes);
+        }
+    }
+
+    fn readAt(spill: *const SpillBuffer, session: *Self, dest: []u8, offset: u64) Error!void {
+        if (spill.file) |file| {
+            session.addStat(.syscalls, 1);
+            session.addStat(.bytes_read, dest.len);
+            if (try file.preadAll(dest, offset) != dest.len) return error.EndOfStream;
+        } else {
+            @memcpy(dest, spill.memory.items[@intCast(offset)..][0..dest.len]);
+        }
+    }
+
+    // Write `len` bytes starting at `offset` to `stream`
+    fn copyRange(spill: *const SpillBuffer, session: *Self, stream: anytype, offset: u64, len: u64) !void {
+        var buffer: [64 * 1024]u8 = undefined;
+        var pos = offset;
+        while (pos < offset + len) {
+            const chunk = buffer[0..@intCast(@min(buffer.len, offset + len - pos))];
+            try spill.readAt(session, chunk, pos);
+            try stream.writeAll(chunk);
+            pos += chunk.len;
+        }
+    }
+
+    fn deinit(spill: *SpillBuffer, session: *Self) void {
+        spill.memory.deinit(session.arena.child_allocator);
+        if (spill.file) |file| {
+            file.close();
+            std.fs.cwd().deleteFile(spill.path) catch {};
+        }
+        spill.* = .{};
+    }
+};
+
+/// Compact record of a resource added to a streaming writer, which is all that's kept of it until the index is written
+const StreamedEntry = extern struct {
+    resource_offset: u64,
+    byte_length: u64,
+    uncompressed_length: u64,
+    name_length: u64,
+    checksum: u32 = 0,
+    resource_type: u8,
+    reserved: [3]u8 = [_]u8{0} ** 3,
+    scratch_bytes: [8]u8 = [_]u8{0} ** 8,
+    content_digest: [Blake3.digest_length]u8 = [_]u8{0} ** Blake3.digest_length,
+};
+
+/// Use `initStreamingWriter` to create this writer, which writes resources to the output executable as they're added.
+/// Unlike `StitchWriter`, identical resources are stored as many times as they're added, and resources of a previous
+/// payload are always rewritten. Resource sources don't need to stay valid after they're added.
+pub const StitchStreamingWriter = struct {
+    session: *Self,
+    outfile: std.fs.File,
+    options: StreamingWriterOptions,
+
+    /// Compression of the next resource. See `setCompression`
+    codec: Codec,
+
+    /// Length of the original executable in the output, which is where the resources start
+    exe_file_len: u64,
+
+    /// Offset in the output where the resources added so far end
+    offset: u64,
+
+    /// Number of resources added
+    resource_count: u64 = 0,
+
+    /// Whether any resource is compressed, in which case uncompressed lengths are written to the index
+    any_compressed: bool = false,
+
+    /// Directory of the temporary files that entries and names are moved to when they outgrow `options.spill_limit`
+    spill_dir: []const u8,
+
+    /// One `StreamedEntry` per resource
+    entries: SpillBuffer = .{},
+
+    /// Resource names, back to back
+    names: SpillBuffer = .{},
+
+    /// Compressed chunks of the `deflate_chunked` resource being added, which are held until the chunk table
+    /// that's stored before them is written
+    chunks: SpillBuffer = .{},
+
+    const Source = union(enum) {
+        bytes: []const u8,
+        file: std.fs.File,
+    };
+
+    /// Closes the stitch session, deletes any temporary files, and frees all resources.
+    /// This must be called to ensure the writer session is properly closed.
+    pub fn deinit(writer: *StitchStreamingWriter) void {
+        writer.entries.deinit(writer.session);
+        writer.names.deinit(writer.session);
+        writer.chunks.deinit(writer.session);
+        writer.session.deinit();
+    }
+
+    /// Compress resources added after this call with `codec`. See `StitchWriter.setCompression`
+    pub fn setCompression(writer: *StitchStreamingWriter, codec: Codec) void {
+        writer.codec = codec;
+    }
+
+    /// Set the scratch bytes for a resource, using the index returned by the addResource... functions.
+    /// The default scratch bytes is all-zero.
+    pub fn setScratchBytes(writer: *StitchStreamingWriter, resource_index: u64, bytes: [8]u8) StitchError!void {
+        writer.session.resetDiagnostics();
+        if (resource_index >= writer.resource_count) {
+            writer.session.setDiagnostics(.{ .ResourceNotFound = .{ .index = resource_index } });
+            return StitchError.ResourceNotFound;
+        }
+        const offset = resource_index * @sizeOf(StreamedEntry) + @offsetOf(StreamedEntry, "scratch_bytes");
+        writer.entries.writeAt(writer.session, &bytes, offset) catch {
+            writer.session.setDiagnostics(.{ .IoError = "Unable to update resource entry" });
+            return StitchError.IoError;
+        };
+    }
+
+    /// Writes the file at `path` to the output as a resource
+    /// If name is null, the name of the resource will be the basename of the path
+    /// Returns the zero-based resource index
+    pub fn addResourceFromPath(writer: *StitchStreamingWriter, name: ?[]const u8, path: []const u8) StitchError!u64 {
+        writer.session.resetDiagnostics();
+        const file = std.fs.cwd().openFile(path, .{ .mode = .read_only }) catch {
+            writer.session.setDiagnostics(.{ .CouldNotOpenInputFile = path });
+            return StitchError.CouldNotOpenInputFile;
+        };
+        defer file.close();
+        return writer.addResource(name orelse std.fs.path.basename(path), .{ .file = file });
+    }
+
+    /// Writes the rest of the reader to the output as a resource. Readers of regular files are copied by the kernel.
+    /// Returns the zero-based resource index
+    pub fn addResourceFromReader(writer: *StitchStreamingWriter, name: []const u8, reader: std.fs.File.Reader) StitchError!u64 {
+        writer.session.resetDiagnostics();
+        return writer.addResource(name, .{ .file = reader.context });
+    }
+
+    /// Writes the slice to the output as a resource
     /// Returns the zero-based resource index
-    pub fn addResourceFromReader(writer: *StitchWriter, name: []const u8, reader: std.fs.File.Reader) !u64 {
+    pub fn addResourceFromSlice(writer: *StitchStreamingWriter, name: []const u8, data: []const u8) StitchError!u64 {
         writer.session.resetDiagnostics();
-        try writer.exe.resources.append(Resource{ .magic = ResourceMagic, .data = .{ .reader = reader } });
-        try writer.exe.index.entries.append(IndexEntry{
-            .name = name,
-            .resource_type = 0,
-            .resource_offset = 0,
+        return writer.addResource(name, .{ .bytes = data });
+    }
+
+    fn addResource(writer: *StitchStreamingWriter, name: []const u8, source: Source) StitchError!u64 {
+        // Wrapper to reclassify errors into StitchError.IoError
+        return writer.addResourceImpl(name, source) catch |err| {
+            if (!Diagnostic.isDiagnostic(err)) {
+                writer.session.setDiagnostics(.{ .IoError = "Unable to write resource to output file" });
+                return StitchError.IoError;
+            }
+            return @as(StitchError, @errorCast(err));
+        };
+    }
+
+    // Write the resource magic and stored bytes after the previous resource, and record its entry
+    fn addResourceImpl(writer: *StitchStreamingWriter, name: []const u8, source: Source) !u64 {
+        const resource_index = writer.resource_count;
+        const span = beginSpan("write resource", resource_index);
+        defer span.end();
+        const session = writer.session;
+        // Compressing any resource selects the version 2 layout at commit, so names are limited regardless of the version
+        if (name.len > std.math.maxInt(u32)) return error.NameTooLong;
+
+        const data_offset = std.mem.alignForward(u64, writer.offset + 8, writer.options.alignment);
+        var magic: [8]u8 = undefined;
+        std.mem.writeInt(u64, &magic, ResourceMagic, .big);
+        session.addStat(.syscalls, 1);
+        session.addStat(.bytes_written, magic.len);
+        try writer.outfile.pwriteAll(&magic, data_offset - 8);
+
+        var entry = StreamedEntry{
+            .resource_offset = data_offset - 8,
             .byte_length = 0,
-            .scratch_bytes = [_]u8{0} ** 8,
-        });
+            .uncompressed_length = 0,
+            .name_length = name.len,
+            .resource_type = switch (writer.codec) {
+                .none => EntryType.blob,
+                .deflate => EntryType.deflate,
+                .deflate_chunked => EntryType.deflate_chunked,
+            },
+        };
+        var hasher = StoredBytesHasher{
+            .digest = if (writer.options.content_digests and writer.codec == .none) Blake3.init(.{}) else null,
+            .checksum = if (writer.options.checksums) 0 else null,
+        };
+        var out = PositionalWriter{ .file = writer.outfile, .pos = data_offset, .session = session, .hasher = &hasher };
+
+        if (writer.codec != .none) {
+            const compress_start = std.time.nanoTimestamp();
+            defer session.addStatTime(.commit_compress_ns, compress_start);
+            var buffered = std.io.BufferedWriter(64 * 1024, PositionalWriter.Writer){ .unbuffered_writer = out.writer() };
+            var content = Blake3.init(.{});
+            var chunk_ends = std.ArrayList(u64).init(session.arena.child_allocator);
+            defer chunk_ends.deinit();
+            if (writer.codec == .deflate_chunked) {
+                defer writer.chunks.deinit(session);
+                entry.uncompressed_length = try writer.compressSource(source, ChunkWriter{ .context = writer }, &content, &chunk_ends);
+                try StitchWriter.writeChunkTable(buffered.writer(), chunk_ends.items);
+                try writer.chunks.copyRange(session, buffered.writer(), 0, writer.chunks.len);
+            } else {
+                entry.uncompressed_length = try writer.compressSource(source, buffered.writer(), &content, &chunk_ends);
+            }
+            try buffered.flush();
+            content.final(&entry.content_digest);
+            writer.any_compressed = true;
+        } else {
+            switch (source) {
+                .bytes => |bytes| try out.writer().writeAll(bytes),
+                .file => |file| try writer.copyFile(file, &out),
+            }
+            entry.uncompressed_length = out.pos - data_offset;
+            if (hasher.digest) |*digest| digest.final(&entry.content_digest);
+        }
+        entry.byte_length = out.pos - data_offset;
+        if (hasher.checksum) |checksum| entry.checksum = checksum;
+
+        try writer.entries.append(session, writer.spill_dir, writer.options.spill_limit, std.mem.asBytes(&entry));
+        try writer.names.append(session, writer.spill_dir, writer.options.spill_limit, name);
+        writer.offset = out.pos;
+        writer.resource_count += 1;
+        return resource_index;
+    }
+
+    const ChunkWriter = std.io.Writer(*StitchStreamingWriter, anyerror, appendChunks);
+
+    // Append compressed chunks, which are moved to a temporary file past `options.spill_limit` like entries and names
+    fn appendChunks(writer: *StitchStreamingWriter, bytes: []const u8) anyerror!usize {
+        try writer.chunks.append(writer.session, writer.spill_dir, writer.options.spill_limit, bytes);
+        return bytes.len;
+    }
+
+    // Compress the rest of `source` into `stream`, see `StitchWriter.compressStream`
+    fn compressSource(writer: *StitchStreamingWriter, source: Source, stream: anytype, content: *Blake3, chunk_ends: *std.ArrayList(u64)) !u64 {
+        switch (source) {
+            .bytes => |bytes| {
+                var bytes_stream = std.io.fixedBufferStream(bytes);
+                return StitchWriter.compressStream(writer.codec, bytes_stream.reader(), stream, content, chunk_ends);
+            },
+            .file => |file| return StitchWriter.compressStream(writer.codec, file.reader(), stream, content, chunk_ends),
+        }
+    }
+
+    // Copy the rest of a file to `out`. Regular files that don't need hashing are copied by the kernel,
+    // anything else goes through a fixed-size buffer.
+    fn copyFile(writer: *StitchStreamingWriter, file: std.fs.File, out: *PositionalWriter) !void {
+        const stat = file.stat() catch null;
+        if (stat != null and stat.?.kind == .file and out.hasher.?.digest == null and out.hasher.?.checksum == null) {
+            const pos = try file.getPos();
+            const len = stat.?.size -| pos;
+            try writer.session.copyFileRange(file, pos, out.file, out.pos, len);
+            // The kernel copy doesn't move the cursor, which readers of the file expect past the copied bytes
+            try file.seekTo(pos + len);
+            out.pos += len;
+            return;
+        }
+        var buffer: [64 * 1024]u8 = undefined;
+        while (true) {
+            const bytes_read = try file.read(&buffer);
+            writer.session.addStat(.syscalls, 1);
+            writer.session.addStat(.bytes_read, bytes_read);
+            if (bytes_read == 0) break;
+            try out.writer().writeAll(buffer[0..bytes_read]);
+        }
+    }
+
+    /// Append the index and tail after the resources, which completes the output executable.
+    /// No resources can be added after this.
+    pub fn commit(writer: *StitchStreamingWriter) StitchError!void {
+        // Wrapper to reclassify errors into StitchError.IoError
+        return writer.commitImpl() catch |err| {
+            if (!Diagnostic.isDiagnostic(err)) {
+                writer.session.setDiagnostics(.{ .IoError = "Unable to commit resources to output file" });
+                return StitchError.IoError;
+            }
+            return @as(StitchError, @errorCast(err));
+        };
+    }
+
+    fn commitImpl(writer: *StitchStreamingWriter) !void {
+        const session = writer.session;
+        session.resetDiagnostics();
+        const commit_start = std.time.nanoTimestamp();
+        defer session.addStatTime(.commit_ns, commit_start);
+        defer session.addStatTime(.commit_index_ns, commit_start);
+        const span = beginSpan("write index", null);
+        defer span.end();
+
+        // Entries and names are streamed from memory or the spill files through a single buffer
+        var out = PositionalWriter{ .file = writer.outfile, .pos = writer.offset, .session = session };
+        var buffered = std.io.BufferedWriter(64 * 1024, PositionalWriter.Writer){ .unbuffered_writer = out.writer() };
+        const stream = buffered.writer();
+        const version = payloadVersion(writer.options.format_version, writer.any_compressed);
+        const endian = indexEndian(version);
+
+        // No resources = write empty tail
+        var index_offset: u64 = 0;
+        if (writer.resource_count > 0) {
+            // Version 2 records are used in place by readers, so the index is padded to natural alignment
+            index_offset = writer.offset;
+            if (version >= 2) {
+                const padding = std.mem.alignForward(u64, index_offset, @alignOf(IndexRecord)) - index_offset;
+                try stream.writeByteNTimes(0, padding);
+                index_offset += padding;
+            }
+
+            switch (version) {
+                1 => try writer.writeIndexV1(stream),
+                else => try writer.writeIndexV2(stream),
+            }
+
+            if (writer.any_compressed) {
+                try StitchWriter.writeExtensionHeader(stream, endian, IndexExtension.uncompressed_lengths, writer.resource_count * 8);
+                var it = writer.entryIterator();
+                while (try it.next()) |entry| try stream.writeInt(u64, entry.uncompressed_length, endian);
+            }
+            if (writer.options.alignment > 1) {
+                try StitchWriter.writeExtensionHeader(stream, endian, IndexExtension.resource_alignment, 8);
+                try stream.writeInt(u64, writer.options.alignment, endian);
+                try StitchWriter.writeExtensionHeader(stream, endian, IndexExtension.executable_length, 8);
+                try stream.writeInt(u64, writer.exe_file_len, endian);
+            }
+            if (writer.options.content_digests) {
+                try StitchWriter.writeExtensionHeader(stream, endian, IndexExtension.content_digests, writer.resource_count * Blake3.digest_length);
+                var it = writer.entryIterator();
+                while (try it.next()) |entry| try stream.writeAll(&entry.content_digest);
+            }
+            if (writer.options.checksums) {
+                try StitchWriter.writeExtensionHeader(stream, endian, IndexExtension.checksums, writer.resource_count * 4);
+                var it = writer.entryIterator();
+                while (try it.next()) |entry| try stream.writeInt(u32, entry.checksum, endian);
+            }
+        }
+
+        // Write the tail
+        try stream.writeInt(u64, index_offset, .big);
+        try stream.writeByte(version);
+        try stream.writeInt(u64, eofMagic(version), .big);
+        try buffered.flush();
+
+        // Anything left of a longer, previous payload is truncated
+        try writer.outfile.setEndPos(out.pos);
+    }
+
+    // Write a version 1 index: big-endian fields, with each name stored inline in its entry
+    fn writeIndexV1(writer: *const StitchStreamingWriter, stream: anytype) !void {
+        try stream.writeInt(u64, writer.resource_count, .big);
+        var name_offset: u64 = 0;
+        var it = writer.entryIterator();
+        while (try it.next()) |entry| {
+            try stream.writeInt(u64, entry.name_length, .big);
+            try writer.names.copyRange(writer.session, stream, name_offset, entry.name_length);
+            try stream.writeByte(entry.resource_type);
+            try stream.writeInt(u64, entry.resource_offset, .big);
+            try stream.writeInt(u64, entry.byte_length, .big);
+            try stream.writeAll(&entry.scratch_bytes);
+            name_offset += entry.name_length;
+        }
+    }
+
+    // Write a version 2 index: a header, fixed-size little-endian records, and a string table with all names
+    fn writeIndexV2(writer: *const StitchStreamingWriter, stream: anytype) !void {
+        try stream.writeInt(u64, writer.resource_count, .little);
+        try stream.writeInt(u64, writer.names.len, .little);
+
+        var name_offset: u64 = 0;
+        var it = writer.entryIterator();
+        while (try it.next()) |entry| {
+            try stream.writeInt(u64, entry.resource_offset, .little);
+            try stream.writeInt(u64, entry.byte_length, .little);
+            try stream.writeInt(u64, name_offset, .little);
+            try stream.writeInt(u32, @intCast(entry.name_length), .little);
+            try stream.writeByte(entry.resource_type);
+            try stream.writeByteNTimes(0, 3);
+            try stream.writeAll(&entry.scratch_bytes);
+            name_offset += entry.name_length;
+        }
+
+        try writer.names.copyRange(writer.session, stream, 0, writer.names.len);
+    }
+
+    fn entryIterator(writer: *const StitchStreamingWriter) EntryIterator {
+        return .{ .writer = writer };
+    }
+
+    // Reads back the entries of the added resources in order, a batch at a time
+    const EntryIterator = struct {
+        writer: *const StitchStreamingWriter,
+        batch: [512]StreamedEntry = undefined,
+        /// Index of the first entry in the batch
+        batch_start: u64 = 0,
+        batch_len: usize = 0,
+        /// Index of the entry returned by the next call to `next`
+        index: u64 = 0,
+
+        fn next(it: *EntryIterator) SpillBuffer.Error!?StreamedEntry {
+            if (it.index == it.writer.resource_count) return null;
+            if (it.index == it.batch_start + it.batch_len) {
+                it.batch_start = it.index;
+                it.batch_len = @intCast(@min(it.batch.len, it.writer.resource_count - it.index));
+                try it.writer.entries.readAt(it.writer.session, std.mem.sliceAsBytes(it.batch[0..it.batch_len]), it.index * @sizeOf(StreamedEntry));
+            }
+            const entry = it.batch[@intCast(it.index - it.batch_start)];
+            it.index += 1;
+            return entry;
+        }
+    };
+};
+
+/// Options for `StitchReader.getResourceReaderWithOptions`
+pub const ResourceReaderOptions = struct {
+    /// Size of the read-ahead buffer. Small reads, such as `readByte` or `readInt`, are served from the buffer,
+    /// while reads of at least this size bypass it. Set to 0 to disable buffering.
+    /// Readers in `mapped` sessions are never buffered, since every read is already a memory copy.
+    buffer_size: usize = 64 * 1024,
+    /// Number of decompressed chunks kept by readers of `deflate_chunked` resources. The least recently
+    /// used chunk is replaced when a read needs a chunk that isn't cached.
+    cached_chunks: u32 = 4,
+};
+
+/// Reads a resource, returning EOF when reaching the end of the resource.
+/// Compressed resources are decompressed transparently, using a fixed amount of memory.
+/// Reads go through a read-ahead buffer, and `seekTo` and `getPos` work on positions within the
+/// (uncompressed) resource. Chunked resources are read through a cache of decompressed chunks instead,
+/// so seeking only costs decompressing the chunk that's read next.
+/// Each resource reader keeps its own position and uses positional reads, so any number of resource readers
+/// can be used at the same time, from different threads. A single resource reader must only be used by one thread at a time.
+/// Use `StitchReader.getResourceReader` to create this reader, and call `deinit` when done
+/// to free the read-ahead buffer and the decompression state of compressed resources.
+pub const StitchResourceReader = struct {
+    raw: RawResourceReader,
+    inflater: ?*Inflater = null,
+    /// Chunk table and decompressed chunks of a `deflate_chunked` resource
+    chunks: ?*ChunkCache = null,
+    /// Record of the memory allocated for this reader, which the session frees if `deinit` isn't called
+    memory: ?*ReaderMemory = null,
+    /// The session that allocated the buffer and decompression state
+    session: *Self,
+    /// Read-ahead buffer, which is empty if reads are unbuffered
+    buffer: []u8 = &.{},
+    /// The buffered bytes not yet returned by `read` are `buffer[start..end]`
+    start: usize = 0,
+    end: usize = 0,
+    /// Position within the resource of the next byte returned by `read`
+    pos: u64 = 0,
+    /// Size of the (uncompressed) resource
+    size: u64,
+
+    pub const FileError = RawResourceReader.FileError;
+    pub const Error = FileError || error{InvalidCompressedData};
+    pub const Reader = std.io.Reader(*StitchResourceReader, Error, read);
+
+    pub fn read(self: *StitchResourceReader, dest: []u8) Error!usize {
+        if (self.start == self.end) {
+            // Reads larger than the buffer go directly to the resource
+            if (dest.len >= self.buffer.len) {
+                const bytes_read = try self.readUnbuffered(dest);
+                self.pos += bytes_read;
+                return bytes_read;
+            }
+            self.start = 0;
+            self.end = try self.readUnbuffered(self.buffer);
+        }
+        const len = @min(dest.len, self.end - self.start);
+        @memcpy(dest[0..len], self.buffer[self.start..][0..len]);
+        self.start += len;
+        self.pos += len;
+        return len;
+    }
+
+    fn readUnbuffered(self: *StitchResourceReader, dest: []u8) Error!usize {
+        if (self.inflater) |inflater| {
+            const bytes_read = inflater.decompressor.read(dest) catch |err| return decompressError(err);
+            if (bytes_read == 0 and dest.len > 0 and inflater.raw.expected_checksum != null) try inflater.raw.finish();
+            return bytes_read;
+        }
+        if (self.chunks) |chunks| {
+            if (self.pos >= self.size) return 0;
+            const chunk_index = self.pos / chunks.chunk_size;
+            const chunk = try self.loadChunk(chunks, chunk_index);
+            const offset_in_chunk = self.pos - chunk_index * chunks.chunk_size;
+            if (offset_in_chunk >= chunk.len) return error.InvalidCompressedData;
+            const len = @min(dest.len, chunk.len - offset_in_chunk);
+            @memcpy(dest[0..len], chunk[offset_in_chunk..][0..len]);
+            return len;
+        }
+        return self.raw.read(dest);
+    }
+
+    // Errors reading the stored bytes are passed through, so only errors from the decompressor itself mean the data is corrupt
+    fn decompressError(err: anyerror) Error {
+        inline for (@typeInfo(FileError).ErrorSet.?) |field| {
+            if (err == @field(anyerror, field.name)) return @field(anyerror, field.name);
+        }
+        return error.InvalidCompressedData;
+    }
+
+    // Returns a decompressed chunk, from the cache or by decompressing it into the least recently used cache slot
+    fn loadChunk(self: *StitchResourceReader, chunks: *ChunkCache, chunk_index: u64) Error![]const u8 {
+        const span = beginSpan("load chunk", null);
+        defer span.end();
+        chunks.tick += 1;
+        var victim = &chunks.slots[0];
+        for (chunks.slots) |*slot| {
+            if (slot.chunk == chunk_index) {
+                slot.last_used = chunks.tick;
+                return slot.data[0..slot.len];
+            }
+            if (slot.last_used < victim.last_used) victim = slot;
+        }
+
+        const start = if (chunk_index == 0) 0 else chunks.getEnd(chunk_index - 1);
+        const end = chunks.getEnd(chunk_index);
+        if (end < start or end > self.raw.length - chunks.data_offset) return error.InvalidCompressedData;
+        var raw = RawResourceReader{
+            .underlying_file = self.raw.underlying_file,
+            .offset = self.raw.offset + chunks.data_offset + start,
+            .length = end - start,
+            .mapped = if (self.raw.mapped) |mapped| mapped[chunks.data_offset + start .. chunks.data_offset + end] else null,
+            .session = self.session,
+        };
+        var decompressor = std.compress.flate.decompressor(raw.reader());
+        victim.chunk = null;
+        victim.len = decompressor.reader().readAll(victim.data) catch |err| return decompressError(err);
+        victim.chunk = chunk_index;
+        victim.last_used = chunks.tick;
+        return victim.data[0..victim.len];
+    }
+
+    // Load the chunk table of a chunked resource and allocate the chunk cache
+    fn openChunks(self: *StitchResourceReader, cached_chunks: u32) !void {
+        var header: [16]u8 = undefined;
+        try self.raw.readAt(&header, 0);
+        const chunk_size = std.mem.readInt(u64, header[0..8], .little);
+        const chunk_count = std.mem.readInt(u64, header[8..16], .little);
+        if (chunk_size == 0 or chunk_size > MaxChunkSize) return error.InvalidCompressedData;
+        if (chunk_count != std.math.divCeil(u64, self.size, chunk_size) catch unreachable) return error.InvalidCompressedData;
+        if (chunk_count > (self.raw.length - 16) / 8) return error.InvalidCompressedData;
+
+        {
+            self.session.mutex.lock();
+            defer self.session.mutex.unlock();
+            const allocator = self.session.arena.child_allocator;
+            const memory = try self.trackMemory();
+            const chunks = try allocator.create(ChunkCache);
+            chunks.* = .{ .chunk_size = chunk_size, .data_offset = 16 + chunk_count * 8 };
+            self.chunks = chunks;
+            memory.chunks = chunks;
+            chunks.ends = try allocator.alloc(u8, chunk_count * 8);
+            chunks.slots = try allocator.alloc(ChunkCache.Slot, cached_chunks);
+            @memset(chunks.slots, .{});
+            for (chunks.slots) |*slot| slot.data = try allocator.alloc(u8, chunk_size);
+        }
+        try self.raw.readAt(self.chunks.?.ends, 16);
+    }
+
+    pub fn reader(self: *StitchResourceReader) Reader {
+        return .{ .context = self };
+    }
+
+    /// Returns the position within the resource of the next byte to be read.
+    pub fn getPos(self: *const StitchResourceReader) u64 {
+        return self.pos;
+    }
+
+    /// Returns the size of the resource. For compressed resources, this is the uncompressed size.
+    pub fn getEndPos(self: *const StitchResourceReader) u64 {
+        return self.size;
+    }
+
+    /// Moves to a position within the resource. Positions past the end are clamped to the end.
+    /// Seeking within the buffered bytes is free, as is seeking in chunked resources. Other compressed resources
+    /// are decompressed up to the new position, from the start of the resource when seeking backwards.
+    pub fn seekTo(self: *StitchResourceReader, pos: u64) Error!void {
+        const target = @min(pos, self.size);
+        const buffer_pos = self.pos - self.start;
+        if (target >= buffer_pos and target <= buffer_pos + self.end) {
+            self.start = @intCast(target - buffer_pos);
+            self.pos = target;
+            return;
+        }
+
+        // The decompressor has already produced the buffered bytes, so it's past the read position
+        const decompressed_pos = buffer_pos + self.end;
+        self.start = 0;
+        self.end = 0;
+        if (self.inflater) |inflater| {
+            self.pos = decompressed_pos;
+            if (target < self.pos) {
+                inflater.raw.seekTo(0);
+                inflater.decompressor = std.compress.flate.decompressor(inflater.raw.reader());
+                self.pos = 0;
+            }
+            var discard: [4096]u8 = undefined;
+            while (self.pos < target) {
+                const bytes_read = try self.readUnbuffered(discard[0..@intCast(@min(discard.len, target - self.pos))]);
+                if (bytes_read == 0) break;
+                self.pos += bytes_read;
+            }
+        } else {
+            self.raw.seekTo(target);
+            self.pos = target;
+        }
+    }
+
+    // Allocate the read-ahead buffer and, for compressed resources, the decompression state
+    fn allocate(self: *StitchResourceReader, compressed: bool, buffer_size: usize) error{OutOfMemory}!void {
+        if (!compressed and buffer_size == 0) return;
+        self.session.mutex.lock();
+        defer self.session.mutex.unlock();
+        const allocator = self.session.arena.child_allocator;
+        const memory = try self.trackMemory();
+        if (compressed) {
+            self.inflater = try allocator.create(Inflater);
+            memory.inflater = self.inflater;
+        }
+        if (buffer_size > 0) {
+            self.buffer = try allocator.alloc(u8, buffer_size);
+            memory.buffer = self.buffer;
+        }
+    }
+
+    // Returns the record of this reader's memory, linking a new one into the session if there's none.
+    // The session mutex must be held.
+    fn trackMemory(self: *StitchResourceReader) error{OutOfMemory}!*ReaderMemory {
+        if (self.memory) |memory| return memory;
+        const memory = try self.session.arena.child_allocator.create(ReaderMemory);
+        memory.* = .{ .next = self.session.reader_memory };
+        if (self.session.reader_memory) |head| head.prev = memory;
+        self.session.reader_memory = memory;
+        self.memory = memory;
+        return memory;
+    }
+
+    /// Frees the read-ahead buffer and decompression state. Readers that aren't closed with this are freed
+    /// when the session is closed.
+    pub fn deinit(self: *StitchResourceReader) void {
+        if (self.memory) |memory| {
+            self.session.mutex.lock();
+            defer self.session.mutex.unlock();
+            if (memory.prev) |prev| prev.next = memory.next else self.session.reader_memory = memory.next;
+            if (memory.next) |next| next.prev = memory.prev;
+            memory.free(self.session.arena.child_allocator);
+        }
+        self.memory = null;
+        self.inflater = null;
+        self.chunks = null;
+        self.buffer = &.{};
+        self.start = 0;
+        self.end = 0;
+    }
+};
+
+/// Memory allocated for a resource reader. These records are linked into the session, so the memory of readers
+/// that aren't closed with `StitchResourceReader.deinit` is freed when the session is closed.
+const ReaderMemory = struct {
+    inflater: ?*Inflater = null,
+    buffer: []u8 = &.{},
+    chunks: ?*ChunkCache = null,
+    prev: ?*ReaderMemory = null,
+    next: ?*ReaderMemory = null,
+
+    // Free the reader's memory and this record
+    fn free(memory: *ReaderMemory, allocator: std.mem.Allocator) void {
+        if (memory.inflater) |inflater| allocator.destroy(inflater);
+        if (memory.buffer.len > 0) allocator.free(memory.buffer);
+        if (memory.chunks) |chunks| {
+            for (chunks.slots) |*slot| {
+                if (slot.data.len > 0) allocator.free(slot.data);
+            }
+            if (chunks.slots.len > 0) allocator.free(chunks.slots);
+            if (chunks.ends.len > 0) allocator.free(chunks.ends);
+            allocator.destroy(chunks);
+        }
+        allocator.destroy(memory);
+    }
+};
+
+/// Reads the stored bytes of a resource with positional reads, returning EOF when reaching the end of the resource.
+/// The file cursor is never used. In `mapped` mode, the bytes are copied from the mapping instead.
+const RawResourceReader = struct {
+    underlying_file: std.fs.File,
+    /// Offset of the resource data in the file
+    offset: u64,
+    length: u64,
+    /// The resource data, if the executable is mapped
+    mapped: ?[]const u8 = null,
+    /// Read position within the resource
+    pos: u64 = 0,
+    /// If set, the checksum of the bytes read so far is verified against this when reaching the end
+    expected_checksum: ?u32 = null,
+    checksum: u32 = 0,
+    /// Session whose counters are updated by reads, if any
+    session: ?*Self = null,
+
+    pub const FileError = std.fs.File.PReadError || error{ChecksumMismatch};
+    pub const Reader = std.io.Reader(*RawResourceReader, FileError, read);
+
+    pub fn read(self: *RawResourceReader, dest: []u8) FileError!usize {
+        const len: usize = @intCast(@min(@as(u64, dest.len), self.length - self.pos));
+        if (len == 0) return 0;
+        const bytes_read = if (self.mapped) |mapped| _: {
+            @memcpy(dest[0..len], mapped[self.pos..][0..len]);
+            break :_ len;
+        } else _: {
+            if (self.session) |session| session.addStat(.syscalls, 1);
+            break :_ try self.underlying_file.pread(dest[0..len], self.offset + self.pos);
+        };
+        if (self.session) |session| session.addStat(.bytes_read, bytes_read);
+        self.pos += bytes_read;
+        if (self.expected_checksum) |expected| {
+            self.checksum = crc32c(self.checksum, dest[0..bytes_read]);
+            if (self.pos == self.length and self.checksum != expected) return error.ChecksumMismatch;
+        }
+        return bytes_read;
+    }
+
+    /// Move to a position within the resource. Checksums are only verified for resources read from start to end,
+    /// so this stops verification unless rewinding to the start.
+    pub fn seekTo(self: *RawResourceReader, pos: u64) void {
+        if (pos == 0) {
+            self.checksum = 0;
+        } else if (pos != self.pos) {
+            self.expected_checksum = null;
+        }
+        self.pos = pos;
+    }
+
+    // Read exactly `dest.len` bytes at `pos` within the resource, without moving the read position
+    fn readAt(self: *const RawResourceReader, dest: []u8, pos: u64) !void {
+        if (pos > self.length or self.length - pos < dest.len) return error.EndOfStream;
+        if (self.session) |session| {
+            if (self.mapped == null) session.addStat(.syscalls, 1);
+            session.addStat(.bytes_read, dest.len);
+        }
+        if (self.mapped) |mapped| {
+            @memcpy(dest, mapped[pos..][0..dest.len]);
+            return;
+        }
+        if (try self.underlying_file.preadAll(dest, self.offset + pos) != dest.len) return error.EndOfStream;
+    }
+
+    // Read to the end, so the checksum is verified even if the consumer stops early, such as a decompressor
+    fn finish(self: *RawResourceReader) FileError!void {
+        var buffer: [4096]u8 = undefined;
+        while (try self.read(&buffer) != 0) {}
+    }
+
+    pub fn reader(self: *RawResourceReader) Reader {
+        return .{ .context = self };
+    }
+};
+
+/// Chunk table of a `deflate_chunked` resource, and a least-recently-used cache of its decompressed chunks
+const ChunkCache = struct {
+    /// Uncompressed size of every chunk but the last
+    chunk_size: u64,
+    /// Offset of the first compressed chunk within the stored resource, which is the length of the chunk table
+    data_offset: u64,
+    /// Little-endian end offset of each compressed chunk, relative to `data_offset`
+    ends: []u8 = &.{},
+    slots: []Slot = &.{},
+    /// Incremented on every chunk access, to find the least recently used slot
+    tick: u64 = 0,
+
+    const Slot = struct {
+        /// Index of the chunk held by this slot, if any
+        chunk: ?u64 = null,
+        data: []u8 = &.{},
+        len: usize = 0,
+        last_used: u64 = 0,
+    };
+
+    fn getEnd(chunks: *const ChunkCache, chunk_index: u64) u64 {
+        return std.mem.readInt(u64, chunks.ends[chunk_index * 8 ..][0..8], .little);
+    }
+};
+
+// Decompression state for a compressed resource. This is heap allocated, because the decompressor
+// holds a reader pointing at the raw resource reader, so neither can move.
+const Inflater = struct {
+    raw: RawResourceReader,
+    decompressor: std.compress.flate.Decompressor(RawResourceReader.Reader),
+};
+
+/// Reads index fields from an in-memory index. Running past the end returns `error.EndOfStream`.
+const IndexParser = struct {
+    bytes: []const u8,
+    pos: usize = 0,
+
+    fn readBytes(parser: *IndexParser, len: u64) error{EndOfStream}![]const u8 {
+        if (len > parser.bytes.len - parser.pos) return error.EndOfStream;
+        defer parser.pos += @intCast(len);
+        return parser.bytes[parser.pos..][0..@intCast(len)];
+    }
+
+    fn readInt(parser: *IndexParser, endian: std.builtin.Endian) error{EndOfStream}!u64 {
+        return std.mem.readInt(u64, (try parser.readBytes(8))[0..8], endian);
+    }
+};
+
+/// Reads index fields from the executable through a buffer, without loading the index
+const IndexScanner = struct {
+    session: *Self,
+    pos: u64,
+    end: u64,
+    /// Bytes of the executable starting at `window_start`, in `buffer` or the mapping
+    window: []const u8 = "",
+    window_start: u64 = 0,
+    buffer: [64 * 1024]u8 = undefined,
+
+    fn readInt(in: *IndexScanner, endian: std.builtin.Endian) !u64 {
+        if (in.end - in.pos < 8) return error.EndOfStream;
+        if (in.pos < in.window_start or in.pos + 8 > in.window_start + in.window.len) {
+            const len: usize = @intCast(@min(in.buffer.len, in.end - in.pos));
+            in.window = try in.session.readBytesAt(in.pos, in.buffer[0..len]);
+            in.window_start = in.pos;
+        }
+        defer in.pos += 8;
+        return std.mem.readInt(u64, in.window[@intCast(in.pos - in.window_start)..][0..8], endian);
+    }
+
+    fn skip(in: *IndexScanner, len: u64) error{EndOfStream}!void {
+        if (len > in.end - in.pos) return error.EndOfStream;
+        in.pos += len;
+    }
+};
+
+/// Use `initReader` to create this reader, which allows you to read resources from a stitch file.
+///
+/// Once initialized, a reader session is safe for concurrent use: any number of threads can look up resources,
+/// read them as slices, and stream them through their own `StitchResourceReader`s. All reads are positional
+/// or served from the mapping, and session memory is allocated under a lock. Diagnostics are kept per thread,
+/// so `getDiagnostics` describes the last failed call on the calling thread.
+pub const StitchReader = struct {
+    session: *Self,
+
+    /// Tail and index, allocated once per loaded executable. Copies of the reader, including those of sessions
+    /// sharing the self reader, refer to the same index, which isn't modified once it's loaded.
+    exe: *StitchExecutable,
+
+    /// Whether resources are verified against their checksums when read
+    verify: bool = false,
+
+    /// Set once the index is loaded and parsed. Until then, only the tail and the index header are known.
+    index_loaded: std.atomic.Value(bool) = std.atomic.Value(bool).init(false),
+
+    /// Whether the index is loaded on the first lookup, in which case `readIndexHeader` reads the resource count
+    /// and the extensions needed before that
+    lazy: bool = false,
+
+    /// Number of resources, from the index header of a lazy reader
+    header_count: u64 = 0,
+
+    fn init(session: *Self) !StitchReader {
+        const exe = try session.arena.allocator().create(StitchExecutable);
+        exe.* = .{
+            .resources = std.ArrayList(Resource).init(session.arena.allocator()),
+            .index = .{ .entries = std.ArrayList(IndexEntry).init(session.arena.allocator()) },
+            .tail = .{ .index_offset = 0, .version = 0, .eof_magic = EofMagic },
+        };
+        return .{ .session = session, .exe = exe };
+    }
+
+    /// Closes the stitch reader session, freeing all resources
+    pub fn deinit(reader: *StitchReader) void {
+        reader.session.deinit();
+    }
+
+    /// Reads the tail and index. The index is loaded with a single positional read (or sliced from the
+    /// mapping in `mapped` mode) and parsed from memory; entry names point into the loaded index bytes.
+    pub fn readMetadata(reader: *StitchReader) !void {
+        try reader.readTail();
+        try reader.loadIndex();
+    }
+
+    // Reads and validates the tail, which locates the index
+    fn readTail(reader: *StitchReader) !void {
+        reader.session.resetDiagnostics();
+        const span = beginSpan("read tail", null);
+        defer span.end();
+        const len = try reader.session.getExecutableLength();
+        if (len < 17) {
+            reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "File too short to contain stitch metadata" });
+            return StitchError.InvalidExecutableFormat;
+        }
+
+        // Read the tail
+        var tail_buffer: [17]u8 = undefined;
+        const tail = try reader.session.readBytesAt(len - 17, &tail_buffer);
+        const index_offset = std.mem.readInt(u64, tail[0..8], .big);
+        reader.exe.tail.version = tail[8];
+        reader.exe.tail.eof_magic = std.mem.readInt(u64, tail[9..17], .big);
+        if (reader.exe.tail.eof_magic != EofMagic and reader.exe.tail.eof_magic != EofMagicV2) {
+            reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Invalid stitch EOF magic" });
+            return StitchError.InvalidExecutableFormat;
+        }
+        if (reader.exe.tail.version <= LatestStitchVersion and reader.exe.tail.eof_magic != eofMagic(reader.exe.tail.version)) {
+            reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "EOF magic doesn't match the format version" });
+            return StitchError.InvalidExecutableFormat;
+        }
+
+        // No index means there are no resources
+        if (index_offset == 0) return;
+        if (index_offset > len - 17) {
+            reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Index offset is beyond the end of the file" });
+            return StitchError.InvalidExecutableFormat;
+        }
+        reader.exe.tail.index_offset = index_offset;
+
+        if (reader.exe.tail.version > LatestStitchVersion) {
+            reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Unsupported format version" });
+            return StitchError.InvalidExecutableFormat;
+        }
+    }
+
+    // Loads and parses the index, unless that's already done. Readers opened with `lazy_index` call this on
+    // the first lookup, possibly from several threads at once, so loading is serialized by the session.
+    fn loadIndex(reader: *StitchReader) StitchError!void {
+        if (reader.index_loaded.load(.acquire)) return;
+        reader.session.index_mutex.lock();
+        defer reader.session.index_mutex.unlock();
+        if (reader.index_loaded.load(.acquire)) return;
+        const load_start = std.time.nanoTimestamp();
+        defer reader.session.addStatTime(.index_load_ns, load_start);
+        const span = beginSpan("load index", null);
+        defer span.end();
+
+        const index_offset = reader.exe.tail.index_offset;
+        if (index_offset != 0) {
+            // Load the entire index at once, and parse it from memory
+            const len = reader.session.getExecutableLength() catch {
+                reader.session.setDiagnostics(.{ .IoError = "Failed to get the executable length" });
+                return StitchError.IoError;
+            };
+            const index_bytes = reader.session.loadBytesAt(index_offset, len - 17 - index_offset) catch |err| {
+                reader.session.setDiagnostics(switch (err) {
+                    error.EndOfStream => .{ .InvalidExecutableFormat = "Index is truncated" },
+                    else => .{ .IoError = "Failed to read the index" },
+                });
+                return if (err == error.EndOfStream) StitchError.InvalidExecutableFormat else StitchError.IoError;
+            };
+            reader.parseIndex(index_bytes) catch |err| {
+                // Nothing of a partly parsed index is kept, so a later lookup fails the same way
+                reader.resetIndex();
+                switch (err) {
+                    error.EndOfStream => {
+                        reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Index is truncated" });
+                        return StitchError.InvalidExecutableFormat;
+                    },
+                    error.OutOfMemory => {
+                        reader.session.setDiagnostics(.{ .IoError = "Out of memory loading the index" });
+                        return StitchError.IoError;
+                    },
+                    else => |e| return e,
+                }
+            };
+        }
+        reader.index_loaded.store(true, .release);
+    }
+
+    // Forget the entries, lookup table and extensions of an index that failed to parse. The index mutex must be held.
+    fn resetIndex(reader: *StitchReader) void {
+        reader.session.mutex.lock();
+        defer reader.session.mutex.unlock();
+        const index = &reader.exe.index;
+        index.entries.clearRetainingCapacity();
+        index.lookup.clearRetainingCapacity();
+        index.records = &.{};
+        index.strings = "";
+        index.uncompressed_lengths = "";
+        index.content_digests = "";
+        index.checksums = "";
+    }
+
+    // Reads the resource count at the start of the index and the alignment and executable length extensions, without
+    // loading the index. Version 2 entries and extension payloads are skipped; version 1 entries are read through.
+    fn readIndexHeader(reader: *StitchReader) StitchError!void {
+        reader.scanIndexHeader() catch |err| {
+            reader.session.setDiagnostics(switch (err) {
+                error.EndOfStream => .{ .InvalidExecutableFormat = "Index is truncated" },
+                else => .{ .IoError = "Failed to read the index" },
+            });
+            return if (err == error.EndOfStream) StitchError.InvalidExecutableFormat else StitchError.IoError;
+        };
+    }
+
+    fn scanIndexHeader(reader: *StitchReader) !void {
+        const index_offset = reader.exe.tail.index_offset;
+        if (index_offset == 0) return;
+        const endian = indexEndian(reader.exe.tail.version);
+        var in = IndexScanner{ .session = reader.session, .pos = index_offset, .end = try reader.session.getExecutableLength() - 17 };
+
+        reader.header_count = try in.readInt(endian);
+        if (reader.exe.tail.version >= 2) {
+            const strings_len = try in.readInt(endian);
+            try in.skip(std.math.mul(u64, reader.header_count, @sizeOf(IndexRecord)) catch return error.EndOfStream);
+            try in.skip(strings_len);
+        } else {
+            for (0..reader.header_count) |_| {
+                const name_len = try in.readInt(endian);
+                try in.skip(std.math.add(u64, name_len, 1 + 8 + 8 + 8) catch return error.EndOfStream);
+            }
+        }
 
-        return writer.exe.resources.items.len - 1;
+        while (in.pos < in.end) {
+            const tag = try in.readInt(endian);
+            const len = try in.readInt(endian);
+            if (len == 8 and (tag == IndexExtension.resource_alignment or tag == IndexExtension.executable_length)) {
+                const value = try in.readInt(endian);
+                if (tag == IndexExtension.resource_alignment) reader.exe.index.resource_alignment = value else reader.exe.index.executable_length = value;
+            } else {
+                try in.skip(len);
+            }
+        }
     }
 
-    /// Adds the slice to the list of resources
-    /// The provided `data` buffer must stay valid until `commit` is called
-    /// Returns the zero-based resource index
-    pub fn addResourceFromSlice(writer: *StitchWriter, name: []const u8, data: []const u8) !u64 {
-        writer.session.resetDiagnostics();
-        try writer.exe.resources.append(Resource{ .magic = ResourceMagic, .data = .{ .bytes = data } });
-        try writer.exe.index.entries.append(IndexEntry{
-            .name = name,
-            .resource_type = 0,
-            .resource_offset = 0,
-            .byte_length = data.len,
-            .scratch_bytes = [_]u8{0} ** 8,
-        });
-
-        return writer.exe.resources.items.len - 1;
+    // Parse the loaded index bytes according to the format version, followed by any index extensions
+    fn parseIndex(reader: *StitchReader, index_bytes: []const u8) !void {
+        var in = IndexParser{ .bytes = index_bytes };
+        if (reader.exe.tail.version >= 2) {
+            try reader.parseIndexV2(&in);
+        } else {
+            try reader.parseIndexV1(&in);
+        }
+        try reader.parseExtensions(&in);
+        try reader.buildLookup();
     }
-};
 
-/// Reads the span of a resource, seeking to the start of the resource on first read
-/// and returning EOF if reading beyond the end of the resource.
-/// Use `StitchReader.getResourceReader` to create this reader.
-pub const StitchResourceReader = struct {
-    underlying_file: std.fs.File,
-    offset: u64,
-    limited_reader: std.io.LimitedReader(std.fs.File.Reader),
-    has_read_yet: bool = false,
+    // Parse version 1 index entries
+    fn parseIndexV1(reader: *StitchReader, in: *IndexParser) !void {
+        // Smallest possible entry: name length, type, offset, length and scratch bytes
+        const min_entry_len = 8 + 1 + 8 + 8 + 8;
 
-    pub const FileError = std.fs.File.Reader.Error || std.fs.File.SeekError;
-    pub const Reader = std.io.Reader(*StitchResourceReader, FileError, read);
+        const entry_count = try in.readInt(.big);
+        if (entry_count > in.bytes.len / min_entry_len) return error.EndOfStream;
+        {
+            reader.session.mutex.lock();
+            defer reader.session.mutex.unlock();
+            try reader.exe.index.entries.ensureTotalCapacityPrecise(entry_count);
+        }
 
-    pub fn read(self: *StitchResourceReader, dest: []u8) FileError!usize {
-        if (!self.has_read_yet) {
-            self.has_read_yet = true;
-            try self.underlying_file.seekTo(self.offset);
+        for (0..entry_count) |_| {
+            const name_len = try in.readInt(.big);
+            reader.exe.index.entries.appendAssumeCapacity(IndexEntry{
+                .name = try in.readBytes(name_len),
+                .resource_type = (try in.readBytes(1))[0],
+                .resource_offset = try in.readInt(.big),
+                .byte_length = try in.readInt(.big),
+                .scratch_bytes = (try in.readBytes(8))[0..8].*,
+            });
         }
-        return self.limited_reader.read(dest);
     }
 
-    pub fn reader(self: *StitchResourceReader) Reader {
-        return .{ .context = self };
-    }
-};
+    // A version 2 index is used in place; only the header is parsed, and records are never copied
+    // unless the index is misaligned in the file, which only hand-crafted files can cause.
+    fn parseIndexV2(reader: *StitchReader, in: *IndexParser) !void {
+        const entry_count = try in.readInt(.little);
+        const strings_len = try in.readInt(.little);
+        if (entry_count > (in.bytes.len - in.pos) / @sizeOf(IndexRecord)) return error.EndOfStream;
 
-fn stitchResourceReader(underlying_file: std.fs.File, offset: u64, bytes_left: u64) StitchResourceReader {
-    return .{ .underlying_file = underlying_file, .offset = offset, .limited_reader = std.io.limitedReader(underlying_file.reader(), bytes_left) };
-}
+        var record_bytes = try in.readBytes(entry_count * @sizeOf(IndexRecord));
+        if (!std.mem.isAligned(@intFromPtr(record_bytes.ptr), @alignOf(IndexRecord))) {
+            const aligned = try reader.session.allocSharedAligned(record_bytes.len);
+            @memcpy(aligned, record_bytes);
+            record_bytes = aligned;
+        }
+        const aligned_record_bytes: []align(@alignOf(IndexRecord)) const u8 = @alignCast(record_bytes);
+        reader.exe.index.records = std.mem.bytesAsSlice(IndexRecord, aligned_record_bytes);
+        reader.exe.index.strings = try in.readBytes(strings_len);
+    }
 
-/// Use `initReader` to create this reader, which allows you to read resources from a stitch file.
-pub const StitchReader = struct {
-    session: *Self,
-    exe: StitchExecutable = undefined,
+    // Parse the extensions following the index entries. Unknown extensions are skipped, so newer
+    // writers can add metadata without breaking older readers.
+    fn parseExtensions(reader: *StitchReader, in: *IndexParser) !void {
+        const endian = indexEndian(reader.exe.tail.version);
+        while (in.pos < in.bytes.len) {
+            const tag = try in.readInt(endian);
+            const payload = try in.readBytes(try in.readInt(endian));
+            switch (tag) {
+                IndexExtension.uncompressed_lengths => reader.exe.index.uncompressed_lengths = payload,
+                IndexExtension.content_digests => reader.exe.index.content_digests = payload,
+                IndexExtension.checksums => reader.exe.index.checksums = payload,
+                // Lazy readers have these from the index header already, and may be reading them on other threads
+                IndexExtension.resource_alignment => {
+                    if (!reader.lazy and payload.len == 8) reader.exe.index.resource_alignment = std.mem.readInt(u64, payload[0..8], endian);
+                },
+                IndexExtension.executable_length => {
+                    if (!reader.lazy and payload.len == 8) reader.exe.index.executable_length = std.mem.readInt(u64, payload[0..8], endian);
+                },
+                else => {},
+            }
+        }
+    }
 
-    fn init(session: *Self) StitchReader {
-        return .{
-            .session = session,
-            .exe = .{
-                .resources = std.ArrayList(Resource).init(session.arena.allocator()),
-                .index = .{ .entries = std.ArrayList(IndexEntry).init(session.arena.allocator()) },
-                .tail = .{ .index_offset = 0, .version = 0, .eof_magic = EofMagic },
-            },
+    // Build the name lookup table, so finding resources by name is O(1) on average
+    fn buildLookup(reader: *StitchReader) !void {
+        const count = reader.getLoadedResourceCount();
+        const lookup = &reader.exe.index.lookup;
+        const capacity = std.math.cast(u32, count) orelse {
+            reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Too many resources" });
+            return StitchError.InvalidExecutableFormat;
         };
+        {
+            reader.session.mutex.lock();
+            defer reader.session.mutex.unlock();
+            try lookup.ensureTotalCapacity(reader.session.arena.allocator(), capacity);
+        }
+        for (0..count) |index| {
+            const result = lookup.getOrPutAssumeCapacity((try reader.decodeEntry(index)).name);
+            if (!result.found_existing) result.value_ptr.* = index;
+        }
     }
 
-    /// Closes the stitch reader session, freeing all resources
-    pub fn deinit(reader: *StitchReader) void {
-        reader.session.deinit();
+    // Returns the index entry for a resource, including its uncompressed length
+    fn getEntry(reader: *StitchReader, resource_index: u64) StitchError!IndexEntry {
+        var entry = try reader.getStoredEntry(resource_index);
+        entry.uncompressed_length = entry.byte_length;
+        if (entryCodec(entry.resource_type) != .none) {
+            const lengths = reader.exe.index.uncompressed_lengths;
+            if (lengths.len / 8 <= resource_index) {
+                reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Compressed resource has no uncompressed length" });
+                return StitchError.InvalidExecutableFormat;
+            }
+            entry.uncompressed_length = std.mem.readInt(u64, lengths[resource_index * 8 ..][0..8], indexEndian(reader.exe.tail.version));
+        }
+        return entry;
     }
 
-    pub fn readMetadata(reader: *StitchReader) !void {
-        reader.session.resetDiagnostics();
-        const len = try reader.session.org_exe_file.getEndPos();
-        if (len < 17) {
-            reader.session.diagnostics = .{ .InvalidExecutableFormat = "File too short to contain stitch metadata" };
-            return StitchError.InvalidExecutableFormat;
+    // Returns the index entry as stored. Version 2 entries are decoded from their in-place record.
+    fn getStoredEntry(reader: *StitchReader, resource_index: u64) StitchError!IndexEntry {
+        try reader.loadIndex();
+        return reader.decodeEntry(resource_index);
+    }
+
+    // Same as `getStoredEntry`, once the index is loaded
+    fn decodeEntry(reader: *StitchReader, resource_index: u64) StitchError!IndexEntry {
+        if (resource_index >= reader.getLoadedResourceCount()) {
+            reader.session.setDiagnostics(.{ .ResourceNotFound = .{ .index = resource_index } });
+            return StitchError.ResourceNotFound;
         }
+        if (reader.exe.tail.version < 2) return reader.exe.index.entries.items[resource_index];
 
-        // Read the tail
-        try reader.session.org_exe_file.seekFromEnd(-17);
-        var in = reader.session.org_exe_file.reader();
-        const index_offset = try in.readInt(u64, .big);
-        reader.exe.tail.version = try in.readByte();
-        reader.exe.tail.eof_magic = try in.readInt(u64, .big);
-        if (reader.exe.tail.eof_magic != EofMagic) {
-            reader.session.diagnostics = .{ .InvalidExecutableFormat = "Invalid stitch EOF magic" };
+        const record = &reader.exe.index.records[resource_index];
+        const strings = reader.exe.index.strings;
+        const name_offset = std.mem.littleToNative(u64, record.name_offset);
+        const name_length = std.mem.littleToNative(u32, record.name_length);
+        if (name_offset > strings.len or strings.len - name_offset < name_length) {
+            reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Resource name is outside the string table" });
             return StitchError.InvalidExecutableFormat;
         }
+        return .{
+            .name = strings[name_offset..][0..name_length],
+            .resource_type = record.resource_type,
+            .resource_offset = std.mem.littleToNative(u64, record.resource_offset),
+            .byte_length = std.mem.littleToNative(u64, record.byte_length),
+            .scratch_bytes = record.scratch_bytes,
+        };
+    }
 
-        // No index means there are no resources
-        if (index_offset == 0) return;
+    // Returns where the stitched payload starts, which is the length of the executable it was stitched to
+    fn getPayloadOffset(reader: *StitchReader) !u64 {
+        try reader.loadIndex();
+        const len = try reader.session.getExecutableLength();
+        if (reader.exe.tail.index_offset == 0) return len - 17;
 
-        // Seek to the index, and read it
-        var ally = reader.session.arena.allocator();
-        try reader.session.org_exe_file.seekTo(index_offset);
-        const entry_count = try in.readInt(u64, .big);
-        for (0..entry_count) |_| {
-            const name_len = try in.readInt(u64, .big);
-            const name: []const u8 = _: {
-                if (name_len == 0) break :_ "";
-                const buffer = try ally.alloc(u8, name_len);
-                _ = try in.readAll(buffer);
-                break :_ buffer;
-            };
-            const resource_type = try in.readByte();
-            const resource_offset = try in.readInt(u64, .big);
-            const byte_length = try in.readInt(u64, .big);
-            const scratch_bytes = _: {
-                const buffer = try ally.alloc(u8, 8);
-                _ = try in.readAll(buffer);
-                break :_ buffer;
-            };
+        var first: ?IndexEntry = null;
+        for (0..reader.getResourceCount()) |i| {
+            const entry = try reader.getStoredEntry(i);
+            if (first == null or entry.resource_offset < first.?.resource_offset) first = entry;
+        }
 
-            try reader.exe.index.entries.append(IndexEntry{
-                .name = name,
-                .resource_type = resource_type,
-                .resource_offset = resource_offset,
-                .byte_length = byte_length,
-                .scratch_bytes = scratch_bytes[0..8].*,
-            });
+        // The first resource must start with the resource magic, so a corrupt index can't cut into the executable
+        const start = if (first) |entry| try reader.checkResourceMagic(entry) - 8 else reader.exe.tail.index_offset;
+
+        // Alignment padding before the first resource isn't part of the executable, so re-stitching with a different
+        // alignment doesn't grow it. The recorded length is only trusted if it accounts for less than one alignment of padding.
+        if (reader.exe.index.executable_length) |exe_len| {
+            if (exe_len <= start and start - exe_len < reader.exe.index.resource_alignment) return exe_len;
         }
+        return start;
+    }
+
+    /// Returns the alignment of the resource data offsets, as set by `StitchWriter.setAlignment`. This is 1 if the writer didn't pad resources.
+    pub fn getResourceAlignment(reader: *StitchReader) u64 {
+        return reader.exe.index.resource_alignment;
     }
 
     /// Returns the version of the stitch format used to write the executable
@@ -513,111 +3300,452 @@ pub const StitchReader = struct {
     /// to `getResourceAsSlice` or `getResourceReader` to read the resource.
     pub fn getResourceIndex(reader: *StitchReader, name: []const u8) !usize {
         reader.session.resetDiagnostics();
-        for (reader.exe.index.entries.items, 0..) |entry, index| {
-            if (std.mem.eql(u8, entry.name, name)) return index;
-        }
+        try reader.loadIndex();
+        reader.session.addStat(.lookups, 1);
+        if (reader.exe.index.lookup.get(name)) |index| return index;
 
-        reader.session.diagnostics = .{ .ResourceNotFound = .{ .name = "Resource not found" } };
+        reader.session.addStat(.lookup_misses, 1);
+        reader.session.setDiagnostics(.{ .ResourceNotFound = .{ .name = "Resource not found" } });
         return StitchError.ResourceNotFound;
     }
 
-    /// Returns the size of the resource in bytes.
+    /// Returns the size of the resource in bytes. For compressed resources, this is the uncompressed size.
     pub fn getResourceSize(reader: *StitchReader, resource_index: usize) !u64 {
         reader.session.resetDiagnostics();
-        if (resource_index > reader.exe.index.entries.items.len) {
-            reader.session.diagnostics = .{ .ResourceNotFound = .{ .index = resource_index } };
-            return StitchError.ResourceNotFound;
-        }
-        return reader.exe.index.entries.items[resource_index].byte_length;
+        return (try reader.getEntry(resource_index)).uncompressed_length;
     }
 
     /// Fully reads the resource into memory and returns it. The memory is freed when the session is closed.
+    /// In `mapped` mode, the returned slice points directly into the mapped executable and nothing is copied.
     pub fn getResourceAsSlice(reader: *StitchReader, resource_index: usize) ![]const u8 {
         reader.session.resetDiagnostics();
-        if (resource_index > reader.exe.index.entries.items.len) {
-            reader.session.diagnostics = .{ .ResourceNotFound = .{ .index = resource_index } };
-            return StitchError.ResourceNotFound;
+        const span = beginSpan("read resource", resource_index);
+        defer span.end();
+        const entry = try reader.getEntry(resource_index);
+
+        // Compressed resources are always decompressed into session memory. Reading exactly the uncompressed length
+        // never reaches the end of the deflate stream, where its checksum is checked, so it's verified up front.
+        if (entryCodec(entry.resource_type) != .none) {
+            if (reader.verify) try reader.verifyResource(resource_index);
+            const buffer = try reader.session.allocShared(entry.uncompressed_length);
+            var resource_reader = try reader.getResourceReaderWithOptions(resource_index, .{ .buffer_size = 0, .cached_chunks = 1 });
+            defer resource_reader.deinit();
+            const decompressed_len = resource_reader.reader().readAll(buffer) catch |err| {
+                if (err == error.ChecksumMismatch) {
+                    reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Resource checksum mismatch" });
+                    return StitchError.InvalidExecutableFormat;
+                }
+                reader.session.setDiagnostics(.{ .IoError = "Failed to decompress resource" });
+                return StitchError.IoError;
+            };
+            if (decompressed_len != buffer.len) {
+                reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Decompressed resource is shorter than its uncompressed length" });
+                return StitchError.InvalidExecutableFormat;
+            }
+            return buffer;
         }
 
-        var ally = reader.session.arena.allocator();
+        const data_offset = try reader.checkResourceMagic(entry);
 
-        // Get the offset from the index and read the resource
-        const offset = reader.exe.index.entries.items[resource_index].resource_offset;
-        const length = reader.exe.index.entries.items[resource_index].byte_length;
+        // In mapped mode, the resource is returned directly from the mapping without copying
+        if (reader.session.mapped_exe) |mapped| {
+            const slice = sliceMapping(mapped, data_offset, entry.byte_length) catch {
+                reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Resource extends beyond end of file" });
+                return StitchError.InvalidExecutableFormat;
+            };
+            reader.session.addStat(.bytes_read, slice.len);
+            if (reader.verify) try reader.checkChecksum(resource_index, crc32c(0, slice));
+            return slice;
+        }
 
-        // Seek to the resource and read it
-        reader.session.org_exe_file.seekTo(offset) catch {
-            reader.session.diagnostics = .{ .IoError = "Failed to seek to resource" };
+        const buffer = try reader.session.allocShared(entry.byte_length);
+        reader.session.addStat(.syscalls, 1);
+        const bytes_read = reader.session.org_exe_file.preadAll(buffer, data_offset) catch {
+            reader.session.setDiagnostics(.{ .IoError = "Failed to read resource bytes" });
             return StitchError.IoError;
         };
+        reader.session.addStat(.bytes_read, bytes_read);
+        if (bytes_read != buffer.len) {
+            reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Resource extends beyond end of file" });
+            return StitchError.InvalidExecutableFormat;
+        }
+        if (reader.verify) try reader.checkChecksum(resource_index, crc32c(0, buffer));
+        return buffer;
+    }
+
+    /// Reads up to `dest.len` bytes of the resource, starting at `offset`, into caller memory and returns the number of
+    /// bytes read. This is less than `dest.len` only when the range reaches the end of the resource, and 0 if `offset`
+    /// is at or past the end. Nothing is allocated from the session, so a server can reread resources into one reused
+    /// buffer in constant memory. Uncompressed resources are read with a single positional read, or copied from the
+    /// mapping. Compressed resources are decompressed from the start, except chunked resources, where only the chunks
+    /// overlapping the range are decompressed; the decompression state is freed before returning.
+    /// If the session verifies checksums, the whole resource is verified first.
+    pub fn readResourceInto(reader: *StitchReader, resource_index: usize, offset: u64, dest: []u8) StitchError!usize {
+        reader.session.resetDiagnostics();
+        const span = beginSpan("read resource range", resource_index);
+        defer span.end();
+        const entry = try reader.getEntry(resource_index);
+        if (offset >= entry.uncompressed_length) return 0;
+        const len: usize = @intCast(@min(dest.len, entry.uncompressed_length - offset));
+        if (reader.verify) try reader.verifyResource(resource_index);
 
-        var file_reader = reader.session.org_exe_file.reader();
+        if (entryCodec(entry.resource_type) != .none) {
+            var resource_reader = try reader.getResourceReaderWithOptions(resource_index, .{ .buffer_size = 0, .cached_chunks = 1 });
+            defer resource_reader.deinit();
+            resource_reader.seekTo(offset) catch {
+                reader.session.setDiagnostics(.{ .IoError = "Failed to decompress resource" });
+                return StitchError.IoError;
+            };
+            const bytes_read = resource_reader.reader().readAll(dest[0..len]) catch {
+                reader.session.setDiagnostics(.{ .IoError = "Failed to decompress resource" });
+                return StitchError.IoError;
+            };
+            if (bytes_read != len) {
+                reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Decompressed resource is shorter than its uncompressed length" });
+                return StitchError.InvalidExecutableFormat;
+            }
+            return len;
+        }
 
-        const resource_magic = file_reader.readInt(u64, .big) catch {
-            reader.session.diagnostics = .{ .IoError = "Failed to read resource magic" };
+        const data_offset = try reader.checkResourceMagic(entry);
+        const bytes = reader.session.readBytesAt(data_offset + offset, dest[0..len]) catch |err| {
+            if (err == error.EndOfStream) {
+                reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Resource extends beyond end of file" });
+                return StitchError.InvalidExecutableFormat;
+            }
+            reader.session.setDiagnostics(.{ .IoError = "Failed to read resource bytes" });
             return StitchError.IoError;
         };
+        if (bytes.ptr != dest.ptr) @memcpy(dest[0..len], bytes);
+        return len;
+    }
 
-        if (resource_magic != ResourceMagic) {
-            reader.session.diagnostics = .{ .InvalidExecutableFormat = "Invalid resource magic" };
-            return StitchError.InvalidExecutableFormat;
+    /// Returns a file reader for the resource. The reader is closed when the session is closed.
+    /// This option requires the least amount of memory. Compressed resources are decompressed while reading.
+    /// Call `deinit` on the returned reader to free its read-ahead buffer and decompression state early,
+    /// such as when a long-lived session creates many readers.
+    pub fn getResourceReader(reader: *StitchReader, resource_index: usize) StitchError!StitchResourceReader {
+        return reader.getResourceReaderWithOptions(resource_index, .{});
+    }
+
+    /// Like `getResourceReader`, but with options such as the size of the read-ahead buffer.
+    pub fn getResourceReaderWithOptions(reader: *StitchReader, resource_index: usize, options: ResourceReaderOptions) StitchError!StitchResourceReader {
+        reader.session.resetDiagnostics();
+        const entry = try reader.getEntry(resource_index);
+        const data_offset = try reader.checkResourceMagic(entry);
+
+        var resource_reader = StitchResourceReader{
+            .raw = .{
+                .underlying_file = reader.session.org_exe_file,
+                .offset = data_offset,
+                .length = entry.byte_length,
+                .session = reader.session,
+            },
+            .session = reader.session,
+            .size = entry.uncompressed_length,
+        };
+        if (reader.verify) resource_reader.raw.expected_checksum = reader.getChecksum(resource_index);
+        if (reader.session.mapped_exe) |mapped| {
+            resource_reader.raw.mapped = sliceMapping(mapped, data_offset, entry.byte_length) catch {
+                reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Resource extends beyond end of file" });
+                return StitchError.InvalidExecutableFormat;
+            };
         }
 
-        const buffer = try ally.alloc(u8, length);
-        _ = file_reader.readAll(buffer) catch {
-            reader.session.diagnostics = .{ .IoError = "Failed to read resource bytes" };
+        // Chunked resources are read through their chunk cache, which makes a read-ahead buffer redundant
+        const codec = entryCodec(entry.resource_type);
+        const buffer_size = if (reader.session.mapped_exe != null or codec == .deflate_chunked) 0 else options.buffer_size;
+        resource_reader.allocate(codec == .deflate, buffer_size) catch {
+            resource_reader.deinit();
+            reader.session.setDiagnostics(.{ .IoError = "Out of memory allocating resource reader" });
             return StitchError.IoError;
         };
-        return buffer;
+        if (codec == .deflate_chunked) {
+            // Chunks are read in any order, so the resource is verified up front instead of while reading
+            if (reader.verify) {
+                resource_reader.raw.expected_checksum = null;
+                reader.verifyResource(resource_index) catch |err| {
+                    resource_reader.deinit();
+                    return err;
+                };
+            }
+            resource_reader.openChunks(@max(options.cached_chunks, 1)) catch |err| {
+                resource_reader.deinit();
+                reader.session.setDiagnostics(switch (err) {
+                    error.OutOfMemory => .{ .IoError = "Out of memory allocating chunk cache" },
+                    else => .{ .InvalidExecutableFormat = "Invalid chunk table" },
+                });
+                return if (err == error.OutOfMemory) StitchError.IoError else StitchError.InvalidExecutableFormat;
+            };
+        }
+        if (resource_reader.inflater) |inflater| {
+            inflater.raw = resource_reader.raw;
+            inflater.decompressor = std.compress.flate.decompressor(inflater.raw.reader());
+        }
+        return resource_reader;
     }
 
-    /// Returns a file reader for the resource. The reader is closed when the session is closed.
-    /// This option requires the least amount of memory.
-    pub fn getResourceReader(reader: *StitchReader, resource_index: usize) StitchError!StitchResourceReader {
+    /// Returns a sealed memory file (memfd) holding the resource, which can be passed to `dlopen("/proc/self/fd/N")`
+    /// or `fexecve` without writing the resource to disk. The caller owns the file and must close it.
+    /// Uncompressed resources are copied by the kernel from the executable, and compressed resources are decompressed
+    /// into the file. Once filled, the file is sealed so its contents can no longer change. This is only supported on Linux.
+    pub fn getResourceAsMemfd(reader: *StitchReader, resource_index: usize) StitchError!std.fs.File {
         reader.session.resetDiagnostics();
-        if (resource_index > reader.exe.index.entries.items.len) {
-            reader.session.diagnostics = .{ .ResourceNotFound = .{ .index = resource_index } };
-            return StitchError.ResourceNotFound;
+        const span = beginSpan("extract resource to memory file", resource_index);
+        defer span.end();
+        if (builtin.os.tag == .linux) {
+            const entry = try reader.getEntry(resource_index);
+            const name = entry.name[0..@min(entry.name.len, 200)];
+            const fd = std.os.memfd_create(if (name.len > 0) name else "stitch", std.os.linux.MFD.CLOEXEC | std.os.linux.MFD.ALLOW_SEALING) catch {
+                reader.session.setDiagnostics(.{ .IoError = "Failed to create memory file" });
+                return StitchError.IoError;
+            };
+            const memfd = std.fs.File{ .handle = fd };
+            errdefer memfd.close();
+
+            if (entryCodec(entry.resource_type) != .none) {
+                var resource_reader = try reader.getResourceReaderWithOptions(resource_index, .{ .buffer_size = 0 });
+                defer resource_reader.deinit();
+                var fifo = std.fifo.LinearFifo(u8, .{ .Static = 64 * 1024 }).init();
+                fifo.pump(resource_reader.reader(), memfd.writer()) catch {
+                    reader.session.setDiagnostics(.{ .IoError = "Failed to decompress resource into memory file" });
+                    return StitchError.IoError;
+                };
+            } else {
+                const data_offset = try reader.checkResourceMagic(entry);
+                reader.session.copyFileRange(reader.session.org_exe_file, data_offset, memfd, 0, entry.byte_length) catch {
+                    reader.session.setDiagnostics(.{ .IoError = "Failed to copy resource into memory file" });
+                    return StitchError.IoError;
+                };
+            }
+
+            // Sealing the seals too prevents the contents from being unsealed
+            const F = std.os.linux.F;
+            _ = std.os.fcntl(fd, F.ADD_SEALS, F.SEAL_SEAL | F.SEAL_SHRINK | F.SEAL_GROW | F.SEAL_WRITE) catch {
+                reader.session.setDiagnostics(.{ .IoError = "Failed to seal memory file" });
+                return StitchError.IoError;
+            };
+            return memfd;
+        }
+        reader.session.setDiagnostics(.{ .IoError = "Memory files are only supported on Linux" });
+        return StitchError.IoError;
+    }
+
+    /// Verify the stored bytes of the resource against its checksum. Returns `InvalidExecutableFormat` if the
+    /// resource is corrupt. Resources without a checksum, written without `StitchWriter.setChecksums`, always pass.
+    pub fn verifyResource(reader: *StitchReader, resource_index: usize) StitchError!void {
+        reader.session.resetDiagnostics();
+        const span = beginSpan("verify resource", resource_index);
+        defer span.end();
+        const entry = try reader.getStoredEntry(resource_index);
+        if (reader.getChecksum(resource_index) == null) return;
+        const data_offset = try reader.checkResourceMagic(entry);
+
+        var crc: u32 = 0;
+        if (reader.session.mapped_exe) |mapped| {
+            reader.session.addStat(.bytes_read, entry.byte_length);
+            crc = crc32c(0, sliceMapping(mapped, data_offset, entry.byte_length) catch {
+                reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Resource extends beyond end of file" });
+                return StitchError.InvalidExecutableFormat;
+            });
+        } else {
+            var buffer: [64 * 1024]u8 = undefined;
+            var pos: u64 = 0;
+            while (pos < entry.byte_length) {
+                const len: usize = @intCast(@min(buffer.len, entry.byte_length - pos));
+                const bytes_read = reader.session.org_exe_file.preadAll(buffer[0..len], data_offset + pos) catch {
+                    reader.session.setDiagnostics(.{ .IoError = "Failed to read resource bytes" });
+                    return StitchError.IoError;
+                };
+                if (bytes_read != len) {
+                    reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Resource extends beyond end of file" });
+                    return StitchError.InvalidExecutableFormat;
+                }
+                reader.session.addStat(.syscalls, 1);
+                reader.session.addStat(.bytes_read, len);
+                crc = crc32c(crc, buffer[0..len]);
+                pos += len;
+            }
+        }
+        try reader.checkChecksum(resource_index, crc);
+    }
+
+    /// Verify every resource against its checksum, stopping at the first corrupt resource.
+    /// See `verifyResource`.
+    pub fn verifyAll(reader: *StitchReader) StitchError!void {
+        for (0..reader.getResourceCount()) |resource_index| {
+            try reader.verifyResource(resource_index);
+        }
+    }
+
+    // Returns the checksum of the resource's stored bytes, if the writer recorded checksums
+    fn getChecksum(reader: *StitchReader, resource_index: usize) ?u32 {
+        const checksums = reader.exe.index.checksums;
+        if (checksums.len / 4 <= resource_index) return null;
+        return std.mem.readInt(u32, checksums[resource_index * 4 ..][0..4], indexEndian(reader.exe.tail.version));
+    }
+
+    // Compare a computed checksum with the recorded one, if any
+    fn checkChecksum(reader: *StitchReader, resource_index: usize, crc: u32) StitchError!void {
+        const expected = reader.getChecksum(resource_index) orelse return;
+        if (crc != expected) {
+            reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Resource checksum mismatch" });
+            return StitchError.InvalidExecutableFormat;
+        }
+    }
+
+    /// Returns the BLAKE3 digest of the resource's uncompressed content, if the writer recorded content digests.
+    pub fn getContentDigest(reader: *StitchReader, resource_index: usize) StitchError!?*const [Blake3.digest_length]u8 {
+        reader.session.resetDiagnostics();
+        _ = try reader.getStoredEntry(resource_index);
+        const digests = reader.exe.index.content_digests;
+        if (digests.len / Blake3.digest_length <= resource_index) return null;
+        return digests[resource_index * Blake3.digest_length ..][0..Blake3.digest_length];
+    }
+
+    /// Extracts the resource to a file in `cache_dir_path` and returns the path of the file, which is freed when the
+    /// session is closed. Each resource is extracted once and then reused by later runs and other processes, so reusing
+    /// an extracted file only costs a `stat`. If the executable has content digests (see `StitchWriter.setContentDigests`),
+    /// files are named by the digest of their content and are also shared by executables with the same resource; otherwise
+    /// they're named by a digest of the executable's identity and the resource's location in it, and a rebuilt executable
+    /// extracts its resources again. Files are written under a temporary name, made executable, and renamed into place,
+    /// so a file in the cache is always complete, even with concurrent extractions.
+    pub fn extractResource(reader: *StitchReader, resource_index: usize, cache_dir_path: []const u8) StitchError![:0]const u8 {
+        reader.session.resetDiagnostics();
+        const span = beginSpan("extract resource", resource_index);
+        defer span.end();
+        const entry = try reader.getEntry(resource_index);
+
+        var digest: [Blake3.digest_length]u8 = undefined;
+        if (try reader.getContentDigest(resource_index)) |stored| {
+            digest = stored.*;
+        } else {
+            // Without a content digest, the name is derived from the index and the executable's metadata, rather than
+            // by reading the resource. Rebuilding the executable changes its inode or modification time.
+            const stat = reader.session.org_exe_file.stat() catch {
+                reader.session.setDiagnostics(.{ .IoError = "Failed to stat the executable" });
+                return StitchError.IoError;
+            };
+            var hasher = Blake3.init(.{});
+            hasher.update("stitch resource location");
+            for ([_]u64{ @intCast(stat.inode), stat.size, entry.resource_offset, entry.byte_length, entry.uncompressed_length, entry.resource_type }) |field| {
+                hasher.update(std.mem.asBytes(&std.mem.nativeToLittle(u64, field)));
+            }
+            hasher.update(std.mem.asBytes(&std.mem.nativeToLittle(i128, stat.mtime)));
+            hasher.final(&digest);
         }
 
-        // Get offset and length from the index
-        const offset = reader.exe.index.entries.items[resource_index].resource_offset;
-        const length = reader.exe.index.entries.items[resource_index].byte_length;
+        const name = std.fmt.bytesToHex(digest, .lower);
+        const path = reader.session.allocShared(cache_dir_path.len + 1 + name.len + 1) catch {
+            reader.session.setDiagnostics(.{ .IoError = "Out of memory" });
+            return StitchError.IoError;
+        };
+        _ = std.fmt.bufPrint(path, "{s}{c}{s}\x00", .{ cache_dir_path, std.fs.path.sep, name }) catch unreachable;
+        const extracted_path = path[0 .. path.len - 1 :0];
+
+        // Warm path: the resource has already been extracted
+        if (std.fs.cwd().statFile(extracted_path)) |stat| {
+            if (stat.size == entry.uncompressed_length) return extracted_path;
+        } else |_| {}
 
-        reader.session.org_exe_file.seekTo(offset) catch {
-            reader.session.diagnostics = .{ .IoError = "Failed to seek to resource" };
+        reader.writeCacheFile(resource_index, entry, cache_dir_path, &name) catch {
+            reader.session.setDiagnostics(.{ .IoError = "Failed to extract resource to the cache directory" });
             return StitchError.IoError;
         };
-        var file_reader = reader.session.org_exe_file.reader();
-        const resource_magic = file_reader.readInt(u64, .big) catch {
-            reader.session.diagnostics = .{ .IoError = "Failed to read resource magic" };
+        return extracted_path;
+    }
+
+    // Write the resource to a temporary file in the cache directory, and atomically rename it to `name`
+    fn writeCacheFile(reader: *StitchReader, resource_index: usize, entry: IndexEntry, cache_dir_path: []const u8, name: []const u8) !void {
+        var dir = try std.fs.cwd().makeOpenPath(cache_dir_path, .{});
+        defer dir.close();
+
+        var temp_name_buffer: [Blake3.digest_length * 2 + 32]u8 = undefined;
+        const temp_name = try std.fmt.bufPrint(&temp_name_buffer, "{s}.{x}.tmp", .{ name, std.crypto.random.int(u64) });
+        const file = try dir.createFile(temp_name, .{ .exclusive = true });
+        errdefer dir.deleteFile(temp_name) catch {};
+        {
+            defer file.close();
+            // Extracted resources are typically run or loaded, so they're executable regardless of the umask
+            if (builtin.os.tag != .windows and builtin.os.tag != .wasi) try file.chmod(0o755);
+            if (entryCodec(entry.resource_type) != .none) {
+                var resource_reader = try reader.getResourceReaderWithOptions(resource_index, .{ .buffer_size = 0 });
+                defer resource_reader.deinit();
+                var fifo = std.fifo.LinearFifo(u8, .{ .Static = 64 * 1024 }).init();
+                try fifo.pump(resource_reader.reader(), file.writer());
+            } else {
+                try reader.session.copyFileRange(reader.session.org_exe_file, try reader.checkResourceMagic(entry), file, 0, entry.byte_length);
+            }
+        }
+        try dir.rename(temp_name, name);
+    }
+
+    // Verify the resource magic preceding the resource data, and return the offset of the data
+    fn checkResourceMagic(reader: *StitchReader, entry: IndexEntry) StitchError!u64 {
+        var buffer: [8]u8 = undefined;
+        const magic = reader.session.readBytesAt(entry.resource_offset, &buffer) catch {
+            reader.session.setDiagnostics(.{ .IoError = "Failed to read resource magic" });
             return StitchError.IoError;
         };
-        if (resource_magic != ResourceMagic) {
-            reader.session.diagnostics = .{ .InvalidExecutableFormat = "Invalid resource magic" };
+        if (std.mem.readInt(u64, magic[0..8], .big) != ResourceMagic) {
+            reader.session.setDiagnostics(.{ .InvalidExecutableFormat = "Invalid resource magic" });
             return StitchError.InvalidExecutableFormat;
         }
-
-        return stitchResourceReader(reader.session.org_exe_file, offset + 8, length);
+        return entry.resource_offset + 8;
     }
 
     /// Returns the scratch bytes for the resource, which is all-zeros if not set specifically.
     pub fn getScratchBytes(reader: *StitchReader, resource_index: usize) ![]const u8 {
         reader.session.resetDiagnostics();
-        if (resource_index > reader.exe.index.entries.items.len) {
-            reader.session.diagnostics = .{ .ResourceNotFound = .{ .index = resource_index } };
-            return StitchError.ResourceNotFound;
-        }
-
+        _ = try reader.getEntry(resource_index);
+        if (reader.exe.tail.version >= 2) return &reader.exe.index.records[resource_index].scratch_bytes;
         return &reader.exe.index.entries.items[resource_index].scratch_bytes;
     }
 
     /// Returns the total number of resources in the executable. This may be zero.
     pub fn getResourceCount(reader: *StitchReader) u64 {
+        if (!reader.index_loaded.load(.acquire)) return reader.header_count;
+        return reader.getLoadedResourceCount();
+    }
+
+    // Returns the number of entries in the loaded index
+    fn getLoadedResourceCount(reader: *StitchReader) u64 {
+        if (reader.exe.tail.version >= 2) return reader.exe.index.records.len;
         return reader.exe.index.entries.items.len;
     }
 };
 
+// Returns the length of the executable being read
+fn getExecutableLength(session: *Self) !u64 {
+    if (session.mapped_exe) |mapped| return mapped.len;
+    return session.org_exe_file.getEndPos();
+}
+
+// Returns `buffer.len` bytes of the executable starting at `offset`, using a single positional read.
+// In `mapped` mode, the bytes are sliced from the mapping and `buffer` is left untouched.
+fn readBytesAt(session: *Self, offset: u64, buffer: []u8) ![]const u8 {
+    session.addStat(.bytes_read, buffer.len);
+    if (session.mapped_exe) |mapped| return sliceMapping(mapped, offset, buffer.len);
+    session.addStat(.syscalls, 1);
+    if (try session.org_exe_file.preadAll(buffer, offset) != buffer.len) return error.EndOfStream;
+    return buffer;
+}
+
+// Same as `readBytesAt`, except the bytes are loaded into session memory if the executable isn't mapped.
+// Loaded memory is aligned like the mapping would be for aligned offsets, so version 2 records can be used in place.
+fn loadBytesAt(session: *Self, offset: u64, len: u64) ![]const u8 {
+    if (session.mapped_exe) |mapped| {
+        session.addStat(.bytes_read, len);
+        return sliceMapping(mapped, offset, len);
+    }
+    return session.readBytesAt(offset, try session.allocSharedAligned(len));
+}
+
+fn sliceMapping(mapped: []const u8, offset: u64, len: u64) error{EndOfStream}![]const u8 {
+    if (offset > mapped.len or mapped.len - offset < len) return error.EndOfStream;
+    return mapped[offset..][0..len];
+}
+
 /// Returns the path to the currently running executable.
 /// It's usually not necessary to call this function directly.
 pub fn getSelfPath(session: *Self) StitchError![]const u8 {
@@ -629,7 +3757,7 @@ pub fn getSelfPath(session: *Self) StitchError![]const u8 {
 pub fn readEntireFile(session: *Self, path: []const u8) StitchError![]const u8 {
     var arena_allocator = session.arena.allocator();
     errdefer {
-        session.diagnostics = .{ .IoError = "Failed to read file" };
+        session.setDiagnostics(.{ .IoError = "Failed to read file" });
     }
     const absolute_path = std.fs.realpathAlloc(arena_allocator, path) catch return StitchError.IoError;
     var file = std.fs.openFileAbsolute(absolute_path, .{ .mode = .read_write }) catch return StitchError.IoError;
@@ -672,6 +3800,22 @@ pub fn testSetup() !void {
     }
 }
 
+// Seams for the shared self reader tests, which are only compiled into test builds
+pub usingnamespace if (builtin.is_test) struct {
+    // Same as `initSharedSelfReader`, but the shared session reads `path` instead of the running executable,
+    // so tests can share a stitched fixture
+    pub fn testInitSharedReader(allocator: std.mem.Allocator, path: []const u8) !StitchReader {
+        return initSharedReader(allocator, path);
+    }
+
+    // Number of open sessions sharing the self reader
+    pub fn testSharedReaderRefCount() usize {
+        self_reader.mutex.lock();
+        defer self_reader.mutex.unlock();
+        return self_reader.ref_count;
+    }
+} else struct {};
+
 // Delete the temporary directory structure
 pub fn testTeardown() void {
     std.fs.cwd().deleteFile(".stitch/executable") catch {};
@@ -722,12 +3866,10 @@ pub const C_ABI = struct {
 
     pub export fn stitch_init_reader(executable_path: ?[*:0]const u8, error_code: *u64) callconv(.C) ?*anyopaque {
         error_code.* = 0;
-        if (executable_path == null) {
-            error_code.* = translateError(StitchError.CouldNotOpenInputFile);
-            return null;
-        }
         const allocator = if (builtin.link_libc) std.heap.c_allocator else std.heap.page_allocator;
-        const reader = initReader(allocator, if (executable_path) |p| std.mem.span(p) else null) catch |err| {
+        // Sessions for the running executable share a single loaded index
+        const result = if (executable_path) |p| initReader(allocator, std.mem.span(p)) else initSharedSelfReader(allocator);
+        const reader = result catch |err| {
             error_code.* = translateError(err);
             return null;
         };
@@ -768,6 +3910,82 @@ pub const C_ABI = struct {
         return slice.ptr;
     }
 
+    pub export fn stitch_reader_read(reader: *anyopaque, resource_index: u64, offset: u64, buffer: [*]u8, len: u64, error_code: *u64) callconv(.C) u64 {
+        error_code.* = 0;
+        return fromC(reader).rw.reader.readResourceInto(resource_index, offset, buffer[0..@intCast(len)]) catch |err| {
+            error_code.* = translateError(err);
+            return std.math.maxInt(u64);
+        };
+    }
+
+    pub export fn stitch_reader_open_stream(reader: *anyopaque, resource_index: u64, error_code: *u64) callconv(.C) ?*anyopaque {
+        error_code.* = 0;
+        const session = fromC(reader);
+        const stream = session.createStream() orelse {
+            session.setDiagnostics(.{ .IoError = "Out of memory allocating resource stream" });
+            error_code.* = translateError(StitchError.IoError);
+            return null;
+        };
+        stream.* = session.rw.reader.getResourceReader(resource_index) catch |err| {
+            session.destroyStream(stream);
+            error_code.* = translateError(err);
+            return null;
+        };
+        return stream;
+    }
+
+    pub export fn stitch_stream_read(stream: *anyopaque, buffer: [*]u8, len: u64, error_code: *u64) callconv(.C) u64 {
+        error_code.* = 0;
+        const s = streamFromC(stream);
+        s.session.resetDiagnostics();
+        return s.reader().readAll(buffer[0..@intCast(len)]) catch |err| {
+            error_code.* = streamError(s, err);
+            return std.math.maxInt(u64);
+        };
+    }
+
+    pub export fn stitch_stream_seek(stream: *anyopaque, pos: u64, error_code: *u64) callconv(.C) void {
+        error_code.* = 0;
+        const s = streamFromC(stream);
+        s.session.resetDiagnostics();
+        s.seekTo(pos) catch |err| {
+            error_code.* = streamError(s, err);
+        };
+    }
+
+    pub export fn stitch_stream_tell(stream: *anyopaque) callconv(.C) u64 {
+        return streamFromC(stream).getPos();
+    }
+
+    pub export fn stitch_stream_close(stream: ?*anyopaque) callconv(.C) void {
+        const s = streamFromC(stream orelse return);
+        const session = s.session;
+        s.deinit();
+        session.destroyStream(s);
+    }
+
+    pub export fn stitch_reader_get_resource_memfd(reader: *anyopaque, resource_index: u64, error_code: *u64) callconv(.C) c_int {
+        const file = fromC(reader).rw.reader.getResourceAsMemfd(resource_index) catch |err| {
+            error_code.* = translateError(err);
+            return -1;
+        };
+        return if (builtin.os.tag == .linux) file.handle else -1;
+    }
+
+    pub export fn stitch_reader_extract_resource(reader: *anyopaque, resource_index: u64, cache_dir_path: [*:0]const u8, error_code: *u64) callconv(.C) ?[*:0]const u8 {
+        const path = fromC(reader).rw.reader.extractResource(resource_index, std.mem.span(cache_dir_path)) catch |err| {
+            error_code.* = translateError(err);
+            return null;
+        };
+        return path.ptr;
+    }
+
+    pub export fn stitch_reader_verify_all(reader: *anyopaque, error_code: *u64) callconv(.C) void {
+        fromC(reader).rw.reader.verifyAll() catch |err| {
+            error_code.* = translateError(err);
+        };
+    }
+
     pub export fn stitch_reader_get_scratch_bytes(reader: *anyopaque, resource_index: u64, error_code: *u64) callconv(.C) ?[*]const u8 {
         error_code.* = 0;
         const slice = fromC(reader).rw.reader.getScratchBytes(resource_index) catch |err| {
@@ -797,6 +4015,20 @@ pub const C_ABI = struct {
         };
     }
 
+    pub export fn stitch_writer_set_checksums(writer: *anyopaque, enabled: bool) callconv(.C) void {
+        fromC(writer).rw.writer.setChecksums(enabled);
+    }
+
+    pub export fn stitch_writer_set_content_digests(writer: *anyopaque, enabled: bool) callconv(.C) void {
+        fromC(writer).rw.writer.setContentDigests(enabled);
+    }
+
+    pub export fn stitch_writer_set_alignment(writer: *anyopaque, alignment: u64, error_code: *u64) callconv(.C) void {
+        fromC(writer).rw.writer.setAlignment(alignment) catch |err| {
+            error_code.* = translateError(err);
+        };
+    }
+
     pub export fn stitch_writer_set_scratch_bytes(writer: *anyopaque, resource_index: u64, bytes: [*]const u8, error_code: *u64) callconv(.C) void {
         fromC(writer).rw.writer.setScratchBytes(resource_index, bytes[0..8].*) catch |err| {
             error_code.* = translateError(err);
@@ -817,6 +4049,21 @@ pub const C_ABI = struct {
         return null;
     }
 
+    pub export fn stitch_start_trace(path: [*:0]const u8, error_code: *u64) callconv(.C) void {
+        error_code.* = 0;
+        startTrace(std.mem.span(path)) catch {
+            error_code.* = translateError(StitchError.CouldNotOpenOutputFile);
+        };
+    }
+
+    pub export fn stitch_stop_trace() callconv(.C) void {
+        stopTrace();
+    }
+
+    pub export fn stitch_get_stats(session: *anyopaque, stats: *Stats) callconv(.C) void {
+        stats.* = fromC(session).getStats();
+    }
+
     pub export fn stitch_get_last_error_diagnostic(session: ?*anyopaque) callconv(.C) ?[*:0]const u8 {
         if (session == null) return "Could not get diagnostic: Invalid session";
         var s = fromC(session.?);
@@ -834,6 +4081,7 @@ pub const C_ABI = struct {
             5 => return "Invalid executable format",
             6 => return "Resource not found",
             7 => return "I/O error",
+            8 => return "Invalid argument",
             else => return "Unknown error code",
         }
     }
@@ -851,6 +4099,23 @@ pub const C_ABI = struct {
         return @ptrCast(@alignCast(session));
     }
 
+    fn streamFromC(stream: *anyopaque) *StitchResourceReader {
+        return @ptrCast(@alignCast(stream));
+    }
+
+    // Set the diagnostics for a failed stream read or seek, and return the error code
+    fn streamError(stream: *StitchResourceReader, err: StitchResourceReader.Error) u64 {
+        stream.session.setDiagnostics(switch (err) {
+            error.ChecksumMismatch => .{ .InvalidExecutableFormat = "Resource checksum mismatch" },
+            error.InvalidCompressedData => .{ .InvalidExecutableFormat = "Invalid compressed resource data" },
+            else => .{ .IoError = "Failed to read resource bytes" },
+        });
+        return translateError(switch (err) {
+            error.ChecksumMismatch, error.InvalidCompressedData => StitchError.InvalidExecutableFormat,
+            else => StitchError.IoError,
+        });
+    }
+
     // Map Zig errors to C error codes
     fn translateError(err: anyerror) u64 {
         return switch (err) {
@@ -860,6 +4125,7 @@ pub const C_ABI = struct {
             StitchError.InvalidExecutableFormat => 5,
             StitchError.ResourceNotFound => 6,
             StitchError.IoError => 7,
+            StitchError.InvalidArgument => 8,
             else => 1,
         };
     }
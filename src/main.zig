@@ -14,8 +14,10 @@ pub fn main() !u8 {
 
     const cmdline = try Cmdline.parseArgs(allocator);
 
-    // Create a stitcher
-    var stitcher = Stitch.initWriter(backing_allocator, cmdline.input_files_paths.values()[0], cmdline.output_file_path) catch |err| {
+    // Create a stitcher. An output of "-" is written to stdout, which can be a pipe.
+    const to_stdout = std.mem.eql(u8, cmdline.output_file_path, "-");
+    const executable_path = cmdline.input_files_paths.values()[0];
+    var stitcher = (if (to_stdout) Stitch.initWriterToStream(backing_allocator, executable_path) else Stitch.initWriter(backing_allocator, executable_path, cmdline.output_file_path)) catch |err| {
         switch (err) {
             StitchError.OutputFileAlreadyExists => {
                 try std.io.getStdErr().writer().print("Output file already exists: {s}\n", .{cmdline.output_file_path});
@@ -26,13 +28,25 @@ pub fn main() !u8 {
     };
     defer stitcher.deinit();
 
+    stitcher.setFormatVersion(cmdline.format_version) catch {
+        try std.io.getStdErr().writer().print("Unsupported format version: {d}\n", .{cmdline.format_version});
+        return 1;
+    };
+    stitcher.setAlignment(cmdline.alignment) catch {
+        try std.io.getStdErr().writer().print("Alignment must be a power of two: {d}\n", .{cmdline.alignment});
+        return 1;
+    };
+
+    stitcher.setChecksums(cmdline.checksums);
+
     // Add resources as specified on the command line
     for (cmdline.input_files_paths.values()[1..]) |path| {
         _ = try stitcher.addResourceFromPath(null, path);
     }
 
-    // Commit changes to file
-    stitcher.commit() catch |err| {
+    // Commit changes to file, or stream them to stdout
+    const result = if (to_stdout) stitcher.commitToStream(std.io.getStdOut().writer()) else stitcher.commit();
+    result catch |err| {
         if (stitcher.session.getDiagnostics()) |diagnostics| {
             try diagnostics.print(stitcher.session.arena.allocator());
         } else {
@@ -53,11 +67,27 @@ pub fn main() !u8 {
 ///
 /// Note that --ouput is optional. If missing, the output file will be the same as the first input file (the executable)
 /// ./stitch ./myexecutable file1.txt newname=file2.txt
+///
+/// The format version to write can be selected with --format-version, which must appear before --output
+/// ./stitch ./myexecutable file1.txt --format-version 2 --output my.exe
+///
+/// Resource data can be aligned with --align, which must also appear before --output
+/// ./stitch ./myexecutable weights.bin --align 4096 --output my.exe
+///
+/// Checksums for verifying resources are recorded with --checksums
+/// ./stitch ./myexecutable file1.txt --checksums --output my.exe
+///
+/// An output of - writes the stitched executable to stdout as it's produced, so it can be piped without a temporary file
+/// ./stitch ./myexecutable file1.txt --output - | gzip > my.exe.gz
 pub const Cmdline = struct {
     const help =
         \\Usage:
         \\    stitch <executable> <resource>... [--output <output>]
         \\    stitch <executable> <name>=<resource>... [--output <output>]
+        \\    stitch <executable> <resource>... --format-version <1|2> [--output <output>]
+        \\    stitch <executable> <resource>... --align <bytes> [--output <output>]
+        \\    stitch <executable> <resource>... --checksums [--output <output>]
+        \\    stitch <executable> <resource>... --output -
         \\    stitch --version
         \\
     ;
@@ -68,6 +98,15 @@ pub const Cmdline = struct {
     // If not specified, the output file will be the same as the first input file
     output_file_path: []const u8 = "",
 
+    // Format version to write
+    format_version: u8 = Stitch.StitchVersion,
+
+    // Alignment of resource data in the output
+    alignment: u64 = 1,
+
+    // Whether to record resource checksums
+    checksums: bool = false,
+
     /// Loop through arguments and extract input files and output name
     /// The first input file is the binary onto which the rest of the files are stitched.
     /// Thus, at least two inputs must be given. The "--output <name>" argument is required
@@ -81,7 +120,7 @@ pub const Cmdline = struct {
         if (!arg_it.skip()) @panic("Missing process argument");
 
         while (arg_it.next()) |arg| {
-            if (std.mem.startsWith(u8, arg, "--") and !std.mem.eql(u8, arg, "--output") and !std.mem.eql(u8, arg, "--version") and !std.mem.eql(u8, arg, "--help")) {
+            if (std.mem.startsWith(u8, arg, "--") and !std.mem.eql(u8, arg, "--output") and !std.mem.eql(u8, arg, "--version") and !std.mem.eql(u8, arg, "--help") and !std.mem.eql(u8, arg, "--format-version") and !std.mem.eql(u8, arg, "--align") and !std.mem.eql(u8, arg, "--checksums")) {
                 try std.io.getStdErr().writer().print("Unknown argument: {s}\n\n", .{arg});
                 try std.io.getStdErr().writer().print(help, .{});
                 std.process.exit(0);
@@ -91,10 +130,34 @@ pub const Cmdline = struct {
                 std.process.exit(0);
             }
             if (std.mem.eql(u8, arg, "--version")) {
-                // Format version determines the major version number
-                try std.io.getStdOut().writer().print("stitch version {d}.0.0\n", .{Stitch.StitchVersion});
+                // The default format version determines the major version number
+                const stdout = std.io.getStdOut().writer();
+                try stdout.print("stitch version {d}.0.0\n", .{Stitch.StitchVersion});
+                try stdout.print("format versions: 1-{d}, default {d}\n", .{ Stitch.LatestStitchVersion, Stitch.StitchVersion });
                 std.process.exit(0);
             }
+            if (std.mem.eql(u8, arg, "--format-version")) {
+                const version = arg_it.next() orelse "";
+                cmdline.format_version = std.fmt.parseInt(u8, version, 10) catch {
+                    try std.io.getStdErr().writer().print("Invalid format version: '{s}'\n\n", .{version});
+                    try std.io.getStdErr().writer().print(help, .{});
+                    std.process.exit(0);
+                };
+                continue;
+            }
+            if (std.mem.eql(u8, arg, "--checksums")) {
+                cmdline.checksums = true;
+                continue;
+            }
+            if (std.mem.eql(u8, arg, "--align")) {
+                const alignment = arg_it.next() orelse "";
+                cmdline.alignment = std.fmt.parseInt(u64, alignment, 10) catch {
+                    try std.io.getStdErr().writer().print("Invalid alignment: '{s}'\n\n", .{alignment});
+                    try std.io.getStdErr().writer().print(help, .{});
+                    std.process.exit(0);
+                };
+                continue;
+            }
             if (std.mem.eql(u8, arg, "--output") or std.mem.eql(u8, arg, "-o")) {
                 if (arg_it.next()) |output| {
                     cmdline.output_file_path = output;
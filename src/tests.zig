@@ -1,5 +1,6 @@
 //! Stitch test suite
 const std = @import("std");
+const builtin = @import("builtin");
 const Stitch = @import("lib.zig");
 const StitchError = Stitch.StitchError;
 
@@ -98,6 +99,1247 @@ test "write executable with no resources" {
     }
 }
 
+test "stitch large resources from path and reader" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    // Larger than any internal copy buffer, so multiple copy rounds are needed
+    const large = try allocator.alloc(u8, 3 * 1024 * 1024 + 17);
+    for (large, 0..) |*byte, i| byte.* = @truncate(i *% 31);
+    {
+        var file = try std.fs.cwd().createFile(".stitch/subdir/large.bin", .{});
+        defer file.close();
+        try file.writeAll(large);
+    }
+    defer std.fs.cwd().deleteFile(".stitch/subdir/large.bin") catch {};
+
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        _ = try writer.addResourceFromPath(null, ".stitch/subdir/large.bin");
+        var file = try std.fs.cwd().openFile(".stitch/subdir/large.bin", .{});
+        defer file.close();
+        _ = try writer.addResourceFromReader("from-reader", file.reader());
+        try writer.commit();
+    }
+
+    {
+        var reader = try Stitch.initReader(allocator, random_name);
+        defer reader.deinit();
+        try std.testing.expectEqualSlices(u8, large, try reader.getResourceAsSlice(try reader.getResourceIndex("large.bin")));
+        try std.testing.expectEqualSlices(u8, large, try reader.getResourceAsSlice(try reader.getResourceIndex("from-reader")));
+        const exe = try reader.session.readEntireFile(".stitch/executable");
+        try std.testing.expectEqualSlices(u8, exe, (try reader.session.readEntireFile(random_name))[0..exe.len]);
+    }
+}
+
+test "mapped and file read modes return the same resources" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        _ = try writer.addResourceFromPath(null, ".stitch/one.txt");
+        _ = try writer.addResourceFromSlice("empty", "");
+        _ = try writer.addResourceFromPath(null, ".stitch/two.txt");
+        try writer.commit();
+    }
+
+    var mapped = try Stitch.initReaderWithOptions(allocator, random_name, .{ .mode = .mapped });
+    defer mapped.deinit();
+    var file = try Stitch.initReaderWithOptions(allocator, random_name, .{ .mode = .file });
+    defer file.deinit();
+
+    for (0..3) |index| {
+        try std.testing.expectEqualSlices(u8, try file.getResourceAsSlice(index), try mapped.getResourceAsSlice(index));
+    }
+    try std.testing.expectEqualSlices(u8, "Hello\nWorld", try mapped.getResourceAsSlice(2));
+}
+
+test "find resources by name" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        for (0..1000) |i| {
+            _ = try writer.addResourceFromSlice(try std.fmt.allocPrint(allocator, "resource-{d}", .{i}), "data");
+        }
+        // Duplicate names resolve to the first resource
+        _ = try writer.addResourceFromSlice("resource-7", "duplicate");
+        try writer.commit();
+    }
+
+    var reader = try Stitch.initReader(allocator, random_name);
+    defer reader.deinit();
+    for (0..1000) |i| {
+        try std.testing.expectEqual(i, try reader.getResourceIndex(try std.fmt.allocPrint(allocator, "resource-{d}", .{i})));
+    }
+    try std.testing.expectEqual(@as(usize, 7), try reader.getResourceIndex("resource-7"));
+    try std.testing.expectError(StitchError.ResourceNotFound, reader.getResourceIndex("resource-1000"));
+}
+
+test "write and read format version 2" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        try std.testing.expectError(StitchError.InvalidArgument, writer.setFormatVersion(Stitch.LatestStitchVersion + 1));
+        try writer.setFormatVersion(2);
+        _ = try writer.addResourceFromPath(null, ".stitch/one.txt");
+        const index = try writer.addResourceFromSlice("slice", "abc");
+        try writer.setScratchBytes(index, [8]u8{ 1, 2, 3, 4, 5, 6, 7, 8 });
+        _ = try writer.addResourceFromPath(null, ".stitch/two.txt");
+        try writer.commit();
+    }
+
+    for ([_]Stitch.ReadMode{ .mapped, .file }) |mode| {
+        var reader = try Stitch.initReaderWithOptions(allocator, random_name, .{ .mode = mode });
+        defer reader.deinit();
+        try std.testing.expectEqual(@as(u8, 2), reader.getFormatVersion());
+        try std.testing.expectEqual(@as(u64, 3), reader.getResourceCount());
+        try std.testing.expectEqualSlices(u8, "Hello world", try reader.getResourceAsSlice(try reader.getResourceIndex("one.txt")));
+        try std.testing.expectEqualSlices(u8, "abc", try reader.getResourceAsSlice(1));
+        try std.testing.expectEqualSlices(u8, &[8]u8{ 1, 2, 3, 4, 5, 6, 7, 8 }, try reader.getScratchBytes(1));
+        try std.testing.expectEqual(@as(u64, 11), try reader.getResourceSize(2));
+        try std.testing.expectError(StitchError.ResourceNotFound, reader.getResourceSize(3));
+    }
+
+    // Version 2 has its own EOF magic, so version 1 parsers reject it. The magic must match the version.
+    const file = try std.fs.cwd().openFile(random_name, .{ .mode = .read_write });
+    defer file.close();
+    const len = try file.getEndPos();
+    var magic: [8]u8 = undefined;
+    _ = try file.preadAll(&magic, len - 8);
+    try std.testing.expectEqual(Stitch.EofMagicV2, std.mem.readInt(u64, &magic, .big));
+    std.mem.writeInt(u64, &magic, Stitch.EofMagic, .big);
+    try file.pwriteAll(&magic, len - 8);
+    try std.testing.expectError(StitchError.InvalidExecutableFormat, Stitch.initReader(allocator, random_name));
+}
+
+test "compressed resources are decompressed transparently" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+
+    const text = "(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))\n" ** 1000;
+    for ([_]u8{ 1, 2 }) |version| {
+        {
+            var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+            defer writer.deinit();
+            try writer.setFormatVersion(version);
+            try writer.setCompression(try writer.addResourceFromSlice("fib.lisp", text), .deflate);
+            try writer.setCompression(try writer.addResourceFromPath(null, ".stitch/one.txt"), .deflate);
+            _ = try writer.addResourceFromPath(null, ".stitch/two.txt");
+            try std.testing.expectError(StitchError.ResourceNotFound, writer.setCompression(3, .deflate));
+            try writer.commit();
+        }
+        defer std.fs.cwd().deleteFile(random_name) catch {};
+
+        // Compressed payloads are written as version 3, which readers that predate compression reject
+        var reader = try Stitch.initReader(allocator, random_name);
+        defer reader.deinit();
+        try std.testing.expectEqual(Stitch.CompressedStitchVersion, reader.getFormatVersion());
+        try std.testing.expectEqual(@as(u64, text.len), try reader.getResourceSize(0));
+        try std.testing.expectEqualSlices(u8, text, try reader.getResourceAsSlice(0));
+        try std.testing.expectEqualSlices(u8, "Hello world", try reader.getResourceAsSlice(1));
+        try std.testing.expectEqualSlices(u8, "Hello\nWorld", try reader.getResourceAsSlice(2));
+
+        var rr = try reader.getResourceReader(0);
+        defer rr.deinit();
+        try std.testing.expectEqualSlices(u8, text, try rr.reader().readAllAlloc(allocator, std.math.maxInt(u64)));
+
+        // The compressed payload is much smaller than the text
+        const file_len = (try std.fs.cwd().statFile(random_name)).size;
+        try std.testing.expect(file_len < text.len / 4);
+    }
+}
+
+test "output is identical regardless of commit thread count" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    var outputs: [3][]const u8 = undefined;
+    for ([_]?u32{ 1, 4, null }, &outputs) |thread_count, *output| {
+        const random_name = try Stitch.generateUniqueFileName(allocator);
+        defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        writer.setThreadCount(thread_count);
+        for (0..50) |i| {
+            _ = try writer.addResourceFromPath(try std.fmt.allocPrint(allocator, "one-{d}", .{i}), ".stitch/one.txt");
+            _ = try writer.addResourceFromSlice(try std.fmt.allocPrint(allocator, "slice-{d}", .{i}), "slice data");
+            try writer.setCompression(try writer.addResourceFromPath(try std.fmt.allocPrint(allocator, "two-{d}", .{i}), ".stitch/two.txt"), .deflate);
+        }
+        try writer.commit();
+        output.* = try allocator.dupe(u8, try writer.session.readEntireFile(random_name));
+    }
+
+    try std.testing.expectEqualSlices(u8, outputs[0], outputs[1]);
+    try std.testing.expectEqualSlices(u8, outputs[0], outputs[2]);
+}
+
+test "resource readers can be used concurrently" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        _ = try writer.addResourceFromPath("one", ".stitch/one.txt");
+        try writer.setCompression(try writer.addResourceFromPath("two", ".stitch/two.txt"), .deflate);
+        try writer.commit();
+    }
+
+    var reader = try Stitch.initReaderWithOptions(allocator, random_name, .{ .mode = .file });
+    defer reader.deinit();
+
+    // Interleaved reads of two readers over the same resource don't affect each other
+    var first = try reader.getResourceReader(0);
+    defer first.deinit();
+    var second = try reader.getResourceReader(0);
+    defer second.deinit();
+    var a: [3]u8 = undefined;
+    var b: [3]u8 = undefined;
+    _ = try first.reader().readAll(&a);
+    _ = try second.reader().readAll(&b);
+    try std.testing.expectEqualSlices(u8, &a, &b);
+
+    const Worker = struct {
+        fn run(r: *Stitch.StitchReader, ok: *bool) void {
+            for (0..100) |i| {
+                const index = i % 2;
+                var resource_reader = r.getResourceReader(index) catch return;
+                defer resource_reader.deinit();
+                var buffer: [64]u8 = undefined;
+                const len = resource_reader.reader().readAll(&buffer) catch return;
+                const expected = r.getResourceAsSlice(index) catch return;
+                if (!std.mem.eql(u8, buffer[0..len], expected)) return;
+            }
+            ok.* = true;
+        }
+    };
+
+    var ok = [_]bool{false} ** 4;
+    var threads: [4]std.Thread = undefined;
+    for (&threads, &ok) |*thread, *thread_ok| {
+        thread.* = try std.Thread.spawn(.{}, Worker.run, .{ &reader, thread_ok });
+    }
+    for (threads) |thread| thread.join();
+    for (ok) |thread_ok| try std.testing.expect(thread_ok);
+
+    // Diagnostics are kept per thread, so calls on other threads don't reset or replace this thread's diagnostic
+    const Lookup = struct {
+        fn run(r: *Stitch.StitchReader, name: []const u8) void {
+            _ = r.getResourceIndex(name) catch {};
+        }
+    };
+    try std.testing.expectError(StitchError.ResourceNotFound, reader.getResourceIndex("missing"));
+    (try std.Thread.spawn(.{}, Lookup.run, .{ &reader, "one" })).join();
+    try std.testing.expectEqualStrings("Resource not found", reader.session.getDiagnostics().?.ResourceNotFound.name);
+    _ = try reader.getResourceIndex("one");
+    (try std.Thread.spawn(.{}, Lookup.run, .{ &reader, "missing" })).join();
+    try std.testing.expect(reader.session.getDiagnostics() == null);
+}
+
+test "buffered resource readers read bytes and seek" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        _ = try writer.addResourceFromPath(null, ".stitch/two.txt");
+        try writer.setCompression(try writer.addResourceFromPath(null, ".stitch/two.txt"), .deflate);
+        try writer.commit();
+    }
+
+    var reader = try Stitch.initReaderWithOptions(allocator, random_name, .{ .mode = .file });
+    defer reader.deinit();
+
+    for (0..2) |index| {
+        for ([_]usize{ 0, 4, 4096 }) |buffer_size| {
+            var rr = try reader.getResourceReaderWithOptions(index, .{ .buffer_size = buffer_size });
+            defer rr.deinit();
+            try std.testing.expectEqual(@as(u64, 11), rr.getEndPos());
+
+            var line = std.ArrayList(u8).init(allocator);
+            try rr.reader().streamUntilDelimiter(line.writer(), '\n', null);
+            try std.testing.expectEqualSlices(u8, "Hello", line.items);
+            try std.testing.expectEqual(@as(u64, 6), rr.getPos());
+            try std.testing.expectEqual(@as(u8, 'W'), try rr.reader().readByte());
+
+            try rr.seekTo(1);
+            try std.testing.expectEqual(@as(u8, 'e'), try rr.reader().readByte());
+            try rr.seekTo(10);
+            try std.testing.expectEqual(@as(u8, 'd'), try rr.reader().readByte());
+            try std.testing.expectError(error.EndOfStream, rr.reader().readByte());
+            try rr.seekTo(100);
+            try std.testing.expectEqual(@as(u64, 11), rr.getPos());
+        }
+    }
+}
+
+test "compressed resource readers seek forward past a partly consumed buffer" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    var data: [10000]u8 = undefined;
+    for (&data, 0..) |*byte, i| byte.* = @truncate(i *% 7);
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        try writer.setCompression(try writer.addResourceFromSlice("data", &data), .deflate);
+        try writer.commit();
+    }
+
+    var reader = try Stitch.initReader(allocator, random_name);
+    defer reader.deinit();
+    for ([_]usize{ 16, 64 * 1024 }) |buffer_size| {
+        var rr = try reader.getResourceReaderWithOptions(0, .{ .buffer_size = buffer_size });
+        defer rr.deinit();
+
+        // The first read fills the buffer, of which only 3 bytes are consumed
+        var head: [3]u8 = undefined;
+        try rr.reader().readNoEof(&head);
+        try std.testing.expectEqualSlices(u8, data[0..3], &head);
+        for ([_]u64{ 100, 5000, 9999, 40 }) |pos| {
+            try rr.seekTo(pos);
+            try std.testing.expectEqual(data[pos], try rr.reader().readByte());
+            try std.testing.expectEqual(pos + 1, rr.getPos());
+        }
+    }
+}
+
+test "identical resources are stored once" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    const data = "x" ** 4096;
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        _ = try writer.addResourceFromSlice("a", data);
+        _ = try writer.addResourceFromPath("two", ".stitch/two.txt");
+        _ = try writer.addResourceFromSlice("b", data);
+        _ = try writer.addResourceFromSlice("hello", "Hello\nWorld");
+        try writer.commit();
+    }
+
+    var reader = try Stitch.initReader(allocator, random_name);
+    defer reader.deinit();
+    try std.testing.expectEqualSlices(u8, data, try reader.getResourceAsSlice(try reader.getResourceIndex("b")));
+    try std.testing.expectEqualSlices(u8, "Hello\nWorld", try reader.getResourceAsSlice(try reader.getResourceIndex("hello")));
+
+    // Only one copy of each distinct resource follows the original executable
+    const exe_len = (try std.fs.cwd().statFile(".stitch/executable")).size;
+    const file_len = (try std.fs.cwd().statFile(random_name)).size;
+    try std.testing.expect(file_len - exe_len < 2 * data.len);
+}
+
+test "stitching to the original replaces the previous payload" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    const large = "x" ** 8192;
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        _ = try writer.addResourceFromSlice("large", large);
+        _ = try writer.addResourceFromSlice("removed", "removed data");
+        _ = try writer.addResourceFromSlice("changed", "old");
+        try writer.commit();
+    }
+    const first_len = (try std.fs.cwd().statFile(random_name)).size;
+
+    // Re-stitch twice, which must not accumulate payloads
+    for (0..2) |_| {
+        var writer = try Stitch.initWriter(allocator, random_name, random_name);
+        defer writer.deinit();
+        _ = try writer.addResourceFromSlice("large", large);
+        _ = try writer.addResourceFromSlice("changed", "new");
+        try writer.commit();
+    }
+    try std.testing.expect((try std.fs.cwd().statFile(random_name)).size <= first_len);
+
+    var reader = try Stitch.initReader(allocator, random_name);
+    defer reader.deinit();
+    try std.testing.expectEqual(@as(u64, 2), reader.getResourceCount());
+    try std.testing.expectEqualSlices(u8, large, try reader.getResourceAsSlice(try reader.getResourceIndex("large")));
+    try std.testing.expectEqualSlices(u8, "new", try reader.getResourceAsSlice(try reader.getResourceIndex("changed")));
+    try std.testing.expectError(error.ResourceNotFound, reader.getResourceIndex("removed"));
+
+    // Stitching the result to a new file only copies the original executable
+    const copy_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(copy_name) catch unreachable;
+    {
+        var writer = try Stitch.initWriter(allocator, random_name, copy_name);
+        defer writer.deinit();
+        try writer.commit();
+    }
+    const exe_len = (try std.fs.cwd().statFile(".stitch/executable")).size;
+    try std.testing.expectEqual(exe_len + 17, (try std.fs.cwd().statFile(copy_name)).size);
+}
+
+test "re-stitching with a different alignment doesn't grow the executable" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+    try std.fs.cwd().copyFile(".stitch/executable", std.fs.cwd(), random_name, .{});
+    const exe = try std.fs.cwd().readFileAlloc(allocator, ".stitch/executable", 1024);
+
+    for ([_]u64{ 4096, 64, 1 }) |alignment| {
+        var writer = try Stitch.initWriter(allocator, random_name, random_name);
+        defer writer.deinit();
+        try writer.setAlignment(alignment);
+        _ = try writer.addResourceFromSlice("data", "aligned data");
+        try writer.commit();
+    }
+
+    // Without padding, the first resource magic directly follows the executable
+    const stitched = try std.fs.cwd().readFileAlloc(allocator, random_name, 1024 * 1024);
+    try std.testing.expectEqualSlices(u8, exe, stitched[0..exe.len]);
+    try std.testing.expectEqual(Stitch.ResourceMagic, std.mem.readInt(u64, stitched[exe.len..][0..8], .big));
+
+    var reader = try Stitch.initReader(allocator, random_name);
+    defer reader.deinit();
+    try std.testing.expectEqualSlices(u8, "aligned data", try reader.getResourceAsSlice(0));
+}
+
+test "resource data is aligned" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    for ([_]u64{ 64, 4096 }) |alignment| {
+        const random_name = try Stitch.generateUniqueFileName(allocator);
+        defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+        {
+            var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+            defer writer.deinit();
+            try std.testing.expectError(error.InvalidArgument, writer.setAlignment(48));
+            try writer.setAlignment(alignment);
+            _ = try writer.addResourceFromPath(null, ".stitch/one.txt");
+            _ = try writer.addResourceFromSlice("odd", "abc");
+            _ = try writer.addResourceFromPath(null, ".stitch/two.txt");
+            try writer.commit();
+        }
+
+        var reader = try Stitch.initReaderWithOptions(allocator, random_name, .{ .mode = .mapped });
+        defer reader.deinit();
+        try std.testing.expectEqual(alignment, reader.getResourceAlignment());
+        for (0..3) |index| {
+            const data = try reader.getResourceAsSlice(index);
+            try std.testing.expect(std.mem.isAligned(@intFromPtr(data.ptr), alignment));
+        }
+        try std.testing.expectEqualSlices(u8, "Hello\nWorld", try reader.getResourceAsSlice(2));
+    }
+}
+
+test "extract resources into sealed memory files" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        _ = try writer.addResourceFromPath(null, ".stitch/two.txt");
+        try writer.setCompression(try writer.addResourceFromPath("compressed", ".stitch/two.txt"), .deflate);
+        try writer.commit();
+    }
+
+    var reader = try Stitch.initReader(allocator, random_name);
+    defer reader.deinit();
+    for (0..2) |index| {
+        const memfd = try reader.getResourceAsMemfd(index);
+        defer memfd.close();
+        var buffer: [32]u8 = undefined;
+        try std.testing.expectEqualSlices(u8, "Hello\nWorld", buffer[0..try memfd.preadAll(&buffer, 0)]);
+        // Sealed files can't be written
+        if (memfd.pwriteAll("x", 0)) |_| return error.TestUnexpectedResult else |_| {}
+    }
+}
+
+test "extract resources to a content-addressed cache" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+    defer std.fs.cwd().deleteTree(".stitch/cache") catch {};
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    var names: [2][]const u8 = undefined;
+    for ([_]bool{ true, false }, &names) |content_digests, *name| {
+        name.* = try Stitch.generateUniqueFileName(allocator);
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", name.*);
+        defer writer.deinit();
+        writer.setContentDigests(content_digests);
+        _ = try writer.addResourceFromPath(null, ".stitch/two.txt");
+        try writer.setCompression(try writer.addResourceFromPath("compressed", ".stitch/two.txt"), .deflate);
+        try writer.commit();
+    }
+    defer for (names) |name| std.fs.cwd().deleteFile(name) catch unreachable;
+
+    // With digests in the index, identical content is extracted to the same file. Without them, files are named by
+    // the resource's location in the executable. Either way, a warm extraction doesn't read the resource.
+    var paths: [2][2][]const u8 = undefined;
+    for (names, &paths) |name, *name_paths| {
+        var reader = try Stitch.initReader(allocator, name);
+        defer reader.deinit();
+        try std.testing.expectEqual(name.ptr == names[0].ptr, try reader.getContentDigest(0) != null);
+        for (0..2) |index| {
+            const path = try reader.extractResource(index, ".stitch/cache");
+            name_paths[index] = try allocator.dupe(u8, path);
+            const bytes_read = reader.session.getStats().bytes_read;
+            try std.testing.expectEqualSlices(u8, path, try reader.extractResource(index, ".stitch/cache"));
+            try std.testing.expectEqual(bytes_read, reader.session.getStats().bytes_read);
+
+            const extracted = try std.fs.cwd().readFileAlloc(allocator, path, 1024);
+            try std.testing.expectEqualSlices(u8, "Hello\nWorld", extracted);
+            if (builtin.os.tag != .windows) {
+                const stat = try std.fs.cwd().statFile(path);
+                try std.testing.expectEqual(@as(std.fs.File.Mode, 0o755), stat.mode & 0o777);
+            }
+        }
+    }
+    try std.testing.expectEqualSlices(u8, paths[0][0], paths[0][1]);
+    try std.testing.expect(!std.mem.eql(u8, paths[1][0], paths[1][1]));
+    try std.testing.expect(!std.mem.eql(u8, paths[0][0], paths[1][0]));
+}
+
+test "checksums detect corrupt resources" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    const text = "checksummed " ** 1000;
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        writer.setChecksums(true);
+        _ = try writer.addResourceFromSlice("text", text);
+        try writer.setCompression(try writer.addResourceFromSlice("compressed", text), .deflate);
+        try writer.commit();
+    }
+
+    {
+        var reader = try Stitch.initReaderWithOptions(allocator, random_name, .{ .verify = true });
+        defer reader.deinit();
+        try reader.verifyAll();
+        try std.testing.expectEqualSlices(u8, text, try reader.getResourceAsSlice(0));
+        try std.testing.expectEqualSlices(u8, text, try reader.getResourceAsSlice(1));
+    }
+
+    // Corrupt a byte of each resource. The compressed resource directly follows the uncompressed one.
+    const data = try std.fs.cwd().readFileAlloc(allocator, random_name, 1 << 20);
+    const text_offset = std.mem.indexOf(u8, data, text).?;
+    const file = try std.fs.cwd().openFile(random_name, .{ .mode = .read_write });
+    defer file.close();
+    try file.pwriteAll("X", text_offset + 100);
+    try file.pwriteAll(&.{data[text_offset + text.len + 10] ^ 0xff}, text_offset + text.len + 10);
+
+    for ([_]Stitch.ReadMode{ .mapped, .file }) |mode| {
+        var reader = try Stitch.initReaderWithOptions(allocator, random_name, .{ .mode = mode, .verify = true });
+        defer reader.deinit();
+        try std.testing.expectError(error.InvalidExecutableFormat, reader.verifyAll());
+        try std.testing.expectError(error.InvalidExecutableFormat, reader.verifyResource(1));
+        try std.testing.expectError(error.InvalidExecutableFormat, reader.getResourceAsSlice(0));
+
+        var rr = try reader.getResourceReader(0);
+        defer rr.deinit();
+        try std.testing.expectError(error.ChecksumMismatch, rr.reader().readAllAlloc(allocator, 1 << 20));
+    }
+}
+
+test "verifying readers reject corrupt compressed resources read as slices" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    const text = "compressed and checksummed " ** 1000;
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        writer.setChecksums(true);
+        _ = try writer.addResourceFromSlice("marker", "uncompressed marker");
+        try writer.setCompression(try writer.addResourceFromSlice("compressed", text), .deflate);
+        try writer.commit();
+    }
+
+    // Flip a byte of the deflate stream, which directly follows the uncompressed resource
+    const data = try std.fs.cwd().readFileAlloc(allocator, random_name, 1 << 20);
+    const corrupt_offset = std.mem.indexOf(u8, data, "uncompressed marker").? + "uncompressed marker".len + 10;
+    const file = try std.fs.cwd().openFile(random_name, .{ .mode = .read_write });
+    defer file.close();
+    try file.pwriteAll(&.{data[corrupt_offset] ^ 0xff}, corrupt_offset);
+
+    for ([_]Stitch.ReadMode{ .mapped, .file }) |mode| {
+        var reader = try Stitch.initReaderWithOptions(allocator, random_name, .{ .mode = mode, .verify = true });
+        defer reader.deinit();
+        try std.testing.expectEqualSlices(u8, "uncompressed marker", try reader.getResourceAsSlice(0));
+        try std.testing.expectError(error.InvalidExecutableFormat, reader.getResourceAsSlice(1));
+        try std.testing.expectEqualStrings("Resource checksum mismatch", reader.getDiagnostics().?.InvalidExecutableFormat);
+    }
+}
+
+test "chunked compressed resources support random access" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    // Spans several chunks, with a partial last chunk
+    const text = try allocator.alloc(u8, Stitch.ChunkSize * 5 + 1234);
+    for (text, 0..) |*c, i| c.* = @intCast((i * 7 + i / 1000) % 251);
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        try writer.setCompression(try writer.addResourceFromSlice("chunked", text), .deflate_chunked);
+        try writer.commit();
+    }
+
+    for ([_]Stitch.ReadMode{ .mapped, .file }) |mode| {
+        var reader = try Stitch.initReaderWithOptions(allocator, random_name, .{ .mode = mode });
+        defer reader.deinit();
+        try std.testing.expectEqual(@as(u64, text.len), try reader.getResourceSize(0));
+        try std.testing.expectEqualSlices(u8, text, try reader.getResourceAsSlice(0));
+
+        var rr = try reader.getResourceReaderWithOptions(0, .{ .cached_chunks = 2 });
+        defer rr.deinit();
+        for ([_]u64{ text.len - 1, 3, Stitch.ChunkSize * 4 + 17, Stitch.ChunkSize - 1, Stitch.ChunkSize * 2, 0 }) |pos| {
+            try rr.seekTo(pos);
+            try std.testing.expectEqual(text[pos], try rr.reader().readByte());
+            try std.testing.expectEqual(pos + 1, rr.getPos());
+        }
+
+        // Reads that cross chunk boundaries
+        var buffer: [1000]u8 = undefined;
+        try rr.seekTo(Stitch.ChunkSize * 3 - 500);
+        try rr.reader().readNoEof(&buffer);
+        try std.testing.expectEqualSlices(u8, text[Stitch.ChunkSize * 3 - 500 ..][0..buffer.len], &buffer);
+        try rr.seekTo(text.len - 10);
+        try std.testing.expectEqual(@as(usize, 10), try rr.reader().readAll(&buffer));
+        try std.testing.expectEqualSlices(u8, text[text.len - 10 ..], buffer[0..10]);
+    }
+}
+
+test "lazy index is loaded on first lookup" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+    for ([_]u8{ 1, 2 }) |version| {
+        {
+            var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+            defer writer.deinit();
+            try writer.setFormatVersion(version);
+            try writer.setAlignment(16);
+            _ = try writer.addResourceFromPath(null, ".stitch/one.txt");
+            _ = try writer.addResourceFromPath(null, ".stitch/two.txt");
+            try writer.commit();
+        }
+
+        for ([_]Stitch.ReadMode{ .mapped, .file }) |mode| {
+            var reader = try Stitch.initReaderWithOptions(allocator, random_name, .{ .mode = mode, .lazy_index = true });
+            defer reader.deinit();
+            try std.testing.expectEqual(@as(u64, 2), reader.getResourceCount());
+            try std.testing.expectEqual(@as(u64, 16), reader.getResourceAlignment());
+            try std.testing.expectEqualSlices(u8, "Hello\nWorld", try reader.getResourceAsSlice(try reader.getResourceIndex("two.txt")));
+            try std.testing.expectEqual(@as(u64, 2), reader.getResourceCount());
+            try std.testing.expectEqual(@as(u64, 16), reader.getResourceAlignment());
+        }
+    }
+
+    // Corrupt the name offset of the first version 2 record. Only the first lookup notices, and every later one
+    // fails the same way rather than seeing a partly parsed index.
+    {
+        const file = try std.fs.cwd().openFile(random_name, .{ .mode = .read_write });
+        defer file.close();
+        var tail: [17]u8 = undefined;
+        _ = try file.preadAll(&tail, try file.getEndPos() - 17);
+        try file.pwriteAll(&[_]u8{0xff} ** 8, std.mem.readInt(u64, tail[0..8], .big) + 16 + 16);
+    }
+    try std.testing.expectError(StitchError.InvalidExecutableFormat, Stitch.initReader(allocator, random_name));
+
+    var reader = try Stitch.initReaderWithOptions(allocator, random_name, .{ .lazy_index = true });
+    defer reader.deinit();
+    try std.testing.expectEqual(@as(u8, 2), reader.getFormatVersion());
+    try std.testing.expectEqual(@as(u64, 2), reader.getResourceCount());
+    for (0..2) |_| {
+        try std.testing.expectError(StitchError.InvalidExecutableFormat, reader.getResourceIndex("two.txt"));
+        try std.testing.expectEqualStrings("Resource name is outside the string table", reader.session.getDiagnostics().?.InvalidExecutableFormat);
+    }
+    try std.testing.expectError(StitchError.InvalidExecutableFormat, reader.getResourceSize(0));
+
+    // A version 1 index is read through when a lazy reader is opened, so a corrupt entry length is reported then
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        _ = try writer.addResourceFromPath(null, ".stitch/one.txt");
+        try writer.commit();
+    }
+    {
+        const file = try std.fs.cwd().openFile(random_name, .{ .mode = .read_write });
+        defer file.close();
+        var tail: [17]u8 = undefined;
+        _ = try file.preadAll(&tail, try file.getEndPos() - 17);
+        try file.pwriteAll(&[_]u8{0xff} ** 8, std.mem.readInt(u64, tail[0..8], .big) + 8);
+    }
+    try std.testing.expectError(StitchError.InvalidExecutableFormat, Stitch.initReaderWithOptions(allocator, random_name, .{ .lazy_index = true }));
+}
+
+test "shared self reader isn't cached when loading fails" {
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+
+    // The test executable has no resources, so every attempt reads the tail again and fails
+    for (0..2) |_| {
+        try std.testing.expectError(StitchError.InvalidExecutableFormat, Stitch.initSharedSelfReader(arena.allocator()));
+    }
+}
+
+test "shared reader sessions share one index" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        _ = try writer.addResourceFromPath("one", ".stitch/one.txt");
+        try writer.setCompression(try writer.addResourceFromPath("two", ".stitch/two.txt"), .deflate);
+        for (0..100) |i| {
+            const name = try std.fmt.allocPrint(allocator, "resource-{d}", .{i});
+            _ = try writer.addResourceFromSlice(name, name);
+        }
+        try writer.commit();
+    }
+
+    var first = try Stitch.testInitSharedReader(allocator, random_name);
+    var second = try Stitch.testInitSharedReader(allocator, random_name);
+    try std.testing.expectEqual(@as(usize, 2), Stitch.testSharedReaderRefCount());
+    try std.testing.expect(first.session != second.session);
+    try std.testing.expect(first.session.shared.? == second.session.shared.?);
+
+    // Each session's copy of the reader points at the index parsed once by the shared session
+    try std.testing.expect(first.exe == second.exe);
+    try std.testing.expect(first.exe == first.session.shared.?.rw.reader.exe);
+    try std.testing.expectEqual(@as(u64, 0), first.session.getStats().index_load_ns);
+
+    // Lookups go through the copied lookup tables, and resource readers allocate from each session's own memory
+    const Worker = struct {
+        fn run(r: *Stitch.StitchReader, ok: *bool) void {
+            for (0..100) |i| {
+                const name = std.fmt.allocPrint(std.heap.page_allocator, "resource-{d}", .{i}) catch return;
+                defer std.heap.page_allocator.free(name);
+                const index = r.getResourceIndex(name) catch return;
+                if (!std.mem.eql(u8, r.getResourceAsSlice(index) catch return, name)) return;
+
+                var resource_reader = r.getResourceReader(r.getResourceIndex("two") catch return) catch return;
+                defer resource_reader.deinit();
+                var buffer: [64]u8 = undefined;
+                const len = resource_reader.reader().readAll(&buffer) catch return;
+                if (!std.mem.eql(u8, buffer[0..len], "Hello\nWorld")) return;
+            }
+            ok.* = true;
+        }
+    };
+    var ok = [_]bool{false} ** 4;
+    var threads: [4]std.Thread = undefined;
+    for (&threads, &ok, 0..) |*thread, *thread_ok, i| {
+        thread.* = try std.Thread.spawn(.{}, Worker.run, .{ if (i % 2 == 0) &first else &second, thread_ok });
+    }
+    for (threads) |thread| thread.join();
+    for (ok) |thread_ok| try std.testing.expect(thread_ok);
+
+    // Closing the session that opened the shared state leaves it to the others
+    first.deinit();
+    try std.testing.expectEqual(@as(usize, 1), Stitch.testSharedReaderRefCount());
+    try std.testing.expectEqualSlices(u8, "Hello world", try second.getResourceAsSlice(try second.getResourceIndex("one")));
+
+    var third = try Stitch.testInitSharedReader(allocator, random_name);
+    try std.testing.expect(third.session.shared.? == second.session.shared.?);
+    second.deinit();
+    try std.testing.expectEqualSlices(u8, "resource-99", try third.getResourceAsSlice(try third.getResourceIndex("resource-99")));
+    third.deinit();
+    try std.testing.expectEqual(@as(usize, 0), Stitch.testSharedReaderRefCount());
+
+    // Once the last session is closed, the next one loads the index again
+    var fourth = try Stitch.testInitSharedReader(allocator, random_name);
+    defer fourth.deinit();
+    try std.testing.expectEqual(@as(usize, 1), Stitch.testSharedReaderRefCount());
+    try std.testing.expectEqualSlices(u8, "Hello world", try fourth.getResourceAsSlice(try fourth.getResourceIndex("one")));
+}
+
+test "read resource ranges into caller memory" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    const text = "0123456789" ** 10000;
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        _ = try writer.addResourceFromSlice("plain", text);
+        try writer.setCompression(try writer.addResourceFromSlice("deflate", text), .deflate);
+        try writer.setCompression(try writer.addResourceFromSlice("chunked", text), .deflate_chunked);
+        try writer.commit();
+    }
+
+    for ([_]Stitch.ReadMode{ .mapped, .file }) |mode| {
+        var reader = try Stitch.initReaderWithOptions(allocator, random_name, .{ .mode = mode });
+        defer reader.deinit();
+
+        // The same buffer is reused for every read
+        var buffer: [100]u8 = undefined;
+        for (0..3) |index| {
+            try std.testing.expectEqual(@as(usize, 100), try reader.readResourceInto(index, 0, &buffer));
+            try std.testing.expectEqualSlices(u8, text[0..100], &buffer);
+            try std.testing.expectEqual(@as(usize, 100), try reader.readResourceInto(index, 70_003, &buffer));
+            try std.testing.expectEqualSlices(u8, text[70_003..][0..100], &buffer);
+            try std.testing.expectEqual(@as(usize, 7), try reader.readResourceInto(index, text.len - 7, &buffer));
+            try std.testing.expectEqualSlices(u8, text[text.len - 7 ..], buffer[0..7]);
+            try std.testing.expectEqual(@as(usize, 0), try reader.readResourceInto(index, text.len + 1, &buffer));
+        }
+        try std.testing.expectError(StitchError.ResourceNotFound, reader.readResourceInto(3, 0, &buffer));
+    }
+}
+
+test "sessions count reads, writes and lookups" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        _ = try writer.addResourceFromPath(null, ".stitch/one.txt");
+        _ = try writer.addResourceFromSlice("abc", "abc");
+        try writer.commit();
+
+        const stats = writer.session.getStats();
+        try std.testing.expect(stats.syscalls > 0);
+        try std.testing.expect(stats.bytes_written >= "Hello world".len + "abc".len);
+        try std.testing.expect(stats.commit_ns >= stats.commit_fill_ns);
+    }
+
+    var reader = try Stitch.initReaderWithOptions(allocator, random_name, .{ .mode = .file });
+    defer reader.deinit();
+    const before = reader.session.getStats();
+    try std.testing.expectEqual(@as(u64, 0), before.lookups);
+    try std.testing.expect(before.arena_bytes > 0);
+
+    try std.testing.expectEqualSlices(u8, "abc", try reader.getResourceAsSlice(try reader.getResourceIndex("abc")));
+    try std.testing.expectError(StitchError.ResourceNotFound, reader.getResourceIndex("missing"));
+    const after = reader.session.getStats();
+    try std.testing.expectEqual(@as(u64, 2), after.lookups);
+    try std.testing.expectEqual(@as(u64, 1), after.lookup_misses);
+    // The resource magic and the resource
+    try std.testing.expectEqual(before.bytes_read + 8 + 3, after.bytes_read);
+    try std.testing.expect(after.syscalls > before.syscalls);
+}
+
+test "trace spans are written as Chrome trace events" {
+    if (!Stitch.tracing_enabled) return error.SkipZigTest;
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    try Stitch.startTrace(".stitch/trace.json");
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        _ = try writer.addResourceFromPath(null, ".stitch/one.txt");
+        try writer.commit();
+
+        var reader = try Stitch.initReader(allocator, random_name);
+        defer reader.deinit();
+        _ = try reader.getResourceAsSlice(0);
+    }
+    Stitch.stopTrace();
+
+    const trace = try std.fs.cwd().readFileAlloc(allocator, ".stitch/trace.json", 1 << 20);
+    const parsed = try std.json.parseFromSlice(std.json.Value, allocator, trace, .{});
+    var names = std.StringHashMap(void).init(allocator);
+    for (parsed.value.array.items) |event| {
+        try std.testing.expectEqualSlices(u8, "X", event.object.get("ph").?.string);
+        try names.put(event.object.get("name").?.string, {});
+    }
+    for ([_][]const u8{ "commit", "copy executable", "write index", "write resource", "read tail", "load index", "read resource" }) |name| {
+        try std.testing.expect(names.contains(name));
+    }
+}
+
+test "streaming writer writes resources as they're added" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    try std.testing.expectError(StitchError.InvalidArgument, Stitch.initStreamingWriter(allocator, ".stitch/executable", random_name, .{ .alignment = 48 }));
+    try std.testing.expectError(StitchError.InvalidArgument, Stitch.initStreamingWriter(allocator, ".stitch/executable", random_name, .{ .format_version = 0 }));
+
+    // A small spill limit moves the entries and names to temporary files partway through
+    const resource_count = 1000;
+    for ([_]u8{ 1, 2 }) |version| {
+        defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+        {
+            var writer = try Stitch.initStreamingWriter(allocator, ".stitch/executable", random_name, .{
+                .format_version = version,
+                .alignment = 16,
+                .checksums = true,
+                .content_digests = true,
+                .spill_limit = 4096,
+            });
+            defer writer.deinit();
+            try std.testing.expectEqual(@as(u64, 0), try writer.addResourceFromPath(null, ".stitch/one.txt"));
+            writer.setCompression(.deflate);
+            for (1..resource_count) |i| {
+                const name = try std.fmt.allocPrint(allocator, "resource-{d}", .{i});
+                _ = try writer.addResourceFromSlice(name, name);
+            }
+            try writer.setScratchBytes(0, "scratch!".*);
+            try writer.commit();
+        }
+
+        var reader = try Stitch.initReader(allocator, random_name);
+        defer reader.deinit();
+        try std.testing.expectEqual(Stitch.CompressedStitchVersion, reader.getFormatVersion());
+        try std.testing.expectEqual(@as(u64, resource_count), reader.getResourceCount());
+        try std.testing.expectEqualSlices(u8, "Hello world", try reader.getResourceAsSlice(try reader.getResourceIndex("one.txt")));
+        try std.testing.expectEqualSlices(u8, "scratch!", try reader.getScratchBytes(0));
+        try std.testing.expectEqual(@as(u64, 16), reader.getResourceAlignment());
+        try std.testing.expectEqualSlices(u8, "resource-999", try reader.getResourceAsSlice(try reader.getResourceIndex("resource-999")));
+        try reader.verifyAll();
+        try std.testing.expect((try reader.getContentDigest(1)) != null);
+    }
+}
+
+test "streaming writer invalidates the previous payload when writing in place" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        _ = try writer.addResourceFromPath(null, ".stitch/one.txt");
+        _ = try writer.addResourceFromPath(null, ".stitch/two.txt");
+        try writer.commit();
+    }
+
+    {
+        var writer = try Stitch.initStreamingWriter(allocator, random_name, random_name, .{});
+        defer writer.deinit();
+
+        // Until commit, the old index would point at overwritten resources, so readers reject the file
+        _ = try writer.addResourceFromSlice("new", "A new resource, longer than the ones it overwrites");
+        try std.testing.expectError(StitchError.InvalidExecutableFormat, Stitch.initReader(allocator, random_name));
+        try writer.commit();
+    }
+
+    var reader = try Stitch.initReader(allocator, random_name);
+    defer reader.deinit();
+    try std.testing.expectEqual(@as(u64, 1), reader.getResourceCount());
+    try std.testing.expectEqualSlices(u8, "A new resource, longer than the ones it overwrites", try reader.getResourceAsSlice(try reader.getResourceIndex("new")));
+}
+
+test "commit to a stream writes the same output as commit to a file" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+    const streamed_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(streamed_name) catch unreachable;
+
+    const Setup = struct {
+        fn addResources(writer: *Stitch.StitchWriter) !void {
+            try writer.setFormatVersion(2);
+            try writer.setAlignment(64);
+            writer.setChecksums(true);
+            _ = try writer.addResourceFromPath(null, ".stitch/one.txt");
+            _ = try writer.addResourceFromSlice("copy", "Hello world");
+            try writer.setCompression(try writer.addResourceFromPath(null, ".stitch/two.txt"), .deflate);
+        }
+    };
+
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        try Setup.addResources(&writer);
+        try writer.commit();
+    }
+    const expected = try std.fs.cwd().readFileAlloc(allocator, random_name, std.math.maxInt(usize));
+
+    // Any writer, here one that appends to memory
+    var output = std.ArrayList(u8).init(allocator);
+    {
+        var writer = try Stitch.initWriterToStream(allocator, ".stitch/executable");
+        defer writer.deinit();
+        try Setup.addResources(&writer);
+        try writer.commitToStream(output.writer());
+    }
+    try std.testing.expectEqualSlices(u8, expected, output.items);
+
+    // File writers have file contents sent by the kernel
+    {
+        const file = try std.fs.cwd().createFile(streamed_name, .{});
+        defer file.close();
+        var writer = try Stitch.initWriterToStream(allocator, ".stitch/executable");
+        defer writer.deinit();
+        try Setup.addResources(&writer);
+        try writer.commitToStream(file.writer());
+    }
+    try std.testing.expectEqualSlices(u8, expected, try std.fs.cwd().readFileAlloc(allocator, streamed_name, std.math.maxInt(usize)));
+}
+
+test "compressed readers and pipes are spooled during commit" {
+    if (builtin.os.tag == .windows) return error.SkipZigTest;
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+
+    // Fits in the pipe buffer, so it can be written before the pipe is read
+    const piped = "piped " ** 1000;
+    const fds = try std.os.pipe();
+    const pipe_reader = std.fs.File{ .handle = fds[0] };
+    defer pipe_reader.close();
+    {
+        const pipe_writer = std.fs.File{ .handle = fds[1] };
+        defer pipe_writer.close();
+        try pipe_writer.writeAll(piped);
+    }
+
+    const shared = try std.fs.cwd().openFile(".stitch/one.txt", .{});
+    defer shared.close();
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        try writer.setCompression(try writer.addResourceFromReader("pipe", pipe_reader.reader()), .deflate);
+        // Both resources read the same file, which compression jobs must not race on
+        try writer.setCompression(try writer.addResourceFromReader("first", shared.reader()), .deflate);
+        try writer.setCompression(try writer.addResourceFromReader("second", shared.reader()), .deflate_chunked);
+        try writer.commit();
+    }
+
+    var reader = try Stitch.initReader(allocator, random_name);
+    defer reader.deinit();
+    try std.testing.expectEqualSlices(u8, piped, try reader.getResourceAsSlice(0));
+    try std.testing.expectEqualSlices(u8, "Hello world", try reader.getResourceAsSlice(1));
+    try std.testing.expectEqualSlices(u8, "Hello world", try reader.getResourceAsSlice(2));
+}
+
+test "corrupt index offsets and truncated indices are reported" {
+    try Stitch.testSetup();
+    defer Stitch.testTeardown();
+
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const random_name = try Stitch.generateUniqueFileName(allocator);
+    defer std.fs.cwd().deleteFile(random_name) catch unreachable;
+    {
+        var writer = try Stitch.initWriter(allocator, ".stitch/executable", random_name);
+        defer writer.deinit();
+        try writer.setFormatVersion(2);
+        _ = try writer.addResourceFromPath(null, ".stitch/one.txt");
+        _ = try writer.addResourceFromPath(null, ".stitch/two.txt");
+        try writer.commit();
+    }
+    const file = try std.fs.cwd().openFile(random_name, .{ .mode = .read_write });
+    defer file.close();
+    const len = try file.getEndPos();
+    var tail: [17]u8 = undefined;
+    _ = try file.preadAll(&tail, len - 17);
+    const index_offset = std.mem.readInt(u64, tail[0..8], .big);
+
+    // The files are corrupted under open readers, so the diagnostics of the failing calls can be checked
+    {
+        // An entry count larger than the rest of the index
+        var reader = try Stitch.initReaderWithOptions(allocator, random_name, .{ .mode = .file, .lazy_index = true });
+        defer reader.deinit();
+        var count: [8]u8 = undefined;
+        std.mem.writeInt(u64, &count, 1000, .little);
+        try file.pwriteAll(&count, index_offset);
+        try std.testing.expectError(StitchError.InvalidExecutableFormat, reader.getResourceIndex("one.txt"));
+        try std.testing.expectEqualStrings("Index is truncated", reader.session.getDiagnostics().?.InvalidExecutableFormat);
+        try std.testing.expectError(StitchError.InvalidExecutableFormat, Stitch.initReader(allocator, random_name));
+        std.mem.writeInt(u64, &count, 2, .little);
+        try file.pwriteAll(&count, index_offset);
+    }
+    {
+        // An index offset past the end of the file
+        var reader = try Stitch.initReaderWithOptions(allocator, random_name, .{ .mode = .file });
+        defer reader.deinit();
+        var offset: [8]u8 = undefined;
+        std.mem.writeInt(u64, &offset, len, .big);
+        try file.pwriteAll(&offset, len - 17);
+        try std.testing.expectError(StitchError.InvalidExecutableFormat, reader.readMetadata());
+        try std.testing.expectEqualStrings("Index offset is beyond the end of the file", reader.session.getDiagnostics().?.InvalidExecutableFormat);
+        try std.testing.expectError(StitchError.InvalidExecutableFormat, Stitch.initReader(allocator, random_name));
+    }
+}
+
 test "read invalid exe, too small" {
     try Stitch.testSetup();
     defer Stitch.testTeardown();